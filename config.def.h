@@ -46,10 +46,92 @@ static bool shownewbutton = false;
 /* alt screens */
 static bool allowaltscreen = true;
 
+/*
+ * look up fallback fonts for new characters on a worker thread, drawing a
+ * box in their place until the font is ready
+ */
+static bool asyncfallback = true;
+
+/* remember fallback fonts across runs in $XDG_CACHE_HOME/st */
+static bool fallbackcache = true;
+
+/*
+ * draw box drawing characters and block elements (U+2500 to U+259F) with
+ * rectangles instead of the font, so that they join across cells
+ */
+static bool boxdraw = true;
+
+/*
+ * rasterize glyphs on the client with FreeType and present them through
+ * MIT-SHM instead of drawing with Xft on the server (also -s)
+ */
+static bool softrender = false;
+
+/*
+ * number of tabs that keep their rendered screen while another one is
+ * shown, so that switching back to them is a single copy (0 to disable)
+ */
+static unsigned int tabcache = 4;
+
+/*
+ * number of rendered rows kept, so that a row shown again, as when
+ * scrolling back and forth, is a single copy (0 to disable)
+ */
+static unsigned int rowcache = 128;
+
+/*
+ * number of 24-bit colours (SGR 38;2 and 48;2) kept allocated for drawing,
+ * shared by all tabs; the least recently used ones are freed first
+ */
+static unsigned int truecolours = 256;
+
 /* frames per second st should at maximum draw to the screen */
 static unsigned int xfps = 60;
 static unsigned int actionfps = 30;
 
+/*
+ * jump scroll: while a program writes more than fits on the screen between
+ * two frames, frames are skipped for at most this many milliseconds
+ */
+static unsigned int jumplatency = 100;
+
+/*
+ * latency mode (toggled with MODKEY+Shift+L): key presses are handled before
+ * pending terminal output, and output that arrives less than echotimeout ms
+ * after a key press is drawn at once instead of on the next frame
+ */
+static bool latencymode = true;
+static unsigned int echotimeout = 50;
+
+/*
+ * longest time in ms frames are held while a program does a synchronized
+ * update (mode 2026)
+ */
+static unsigned int synctimeout = 150;
+
+/*
+ * tabs that are not on the screen are read up to bgbatch bytes at a time
+ * and for at most bgshare percent of a frame; while the shown tab has
+ * output or a frame pending, at most bgfps times a second
+ */
+static unsigned int bgfps = 20;
+static unsigned int bgbatch = 256 * 1024;
+static unsigned int bgshare = 25;
+
+#ifdef USE_PRESENT
+/*
+ * with the Present extension (see config.mk), frames are drawn this many
+ * milliseconds before the vblank they are shown on
+ */
+static unsigned int presentmargin = 4;
+#endif
+
+/*
+ * print frame and key press latency statistics to stderr on exit and on
+ * SIGUSR1 (also -l)
+ */
+static bool showstats = false;
+
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
  * attribute.
@@ -221,6 +303,7 @@ static Shortcut shortcuts[] = {
 	{ ShiftMask,		XK_Insert,	selpaste,	{.i =  0} },
 	{ MODKEY|ShiftMask,	XK_Insert,	clippaste,	{.i =  0} },
 	{ MODKEY,		XK_Num_Lock,	numlock,	{.i =  0} },
+	{ MODKEY|ShiftMask,	XK_L,		togglelatency,	{.i =  0} },
 };
 
 /*
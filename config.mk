@@ -14,7 +14,7 @@ X11LIB = /usr/X11R6/lib
 INCS = -I. -I/usr/include -I${X11INC} \
        `pkg-config --cflags fontconfig` \
        `pkg-config --cflags freetype2`
-LIBS = -L/usr/lib -lc -L${X11LIB} -lX11 -lutil -lXext -lXft \
+LIBS = -L/usr/lib -lc -L${X11LIB} -lX11 -lutil -lXext -lXft -lXrender -lpthread \
        `pkg-config --libs fontconfig`  \
        `pkg-config --libs freetype2`
 
@@ -23,6 +23,14 @@ CPPFLAGS = -DVERSION=\"${VERSION}\" -D_BSD_SOURCE -D_XOPEN_SOURCE=600
 CFLAGS += -g -std=c99 -pedantic -Wall -Wvariadic-macros -Os ${INCS} ${CPPFLAGS}
 LDFLAGS += -g ${LIBS}
 
+# uncomment to draw frames on vblank with the Present extension
+#CPPFLAGS += -DUSE_PRESENT
+#LIBS += -lXpresent -lXfixes
+
+# uncomment to shape text with HarfBuzz, for ligatures and complex scripts
+#CPPFLAGS += -DUSE_HARFBUZZ `pkg-config --cflags harfbuzz`
+#LIBS += `pkg-config --libs harfbuzz`
+
 # compiler and linker
 CC ?= cc
 
@@ -0,0 +1,154 @@
+/* See LICENSE for licence details. */
+
+/*
+ * Types into st with XTest and has it report how long each key press took
+ * to be echoed and drawn, e.g. to compare two builds without a screen:
+ *
+ *	xvfb-run ./latency ./st
+ *	xvfb-run ./latency -n 1000 ./st-old -s
+ *
+ * st runs cat, so the tty echoes every key, with its statistics turned on
+ * (st -l).  It prints them to stderr when the driver is done.
+ */
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+#include "arg.h"
+
+#define CLASS "stlatency"
+
+char *argv0;
+
+static int count = 200;	/* keys to type */
+static int delay = 50;	/* milliseconds between them */
+
+void
+die(const char *errstr, ...) {
+	va_list ap;
+
+	va_start(ap, errstr);
+	vfprintf(stderr, errstr, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+void
+usage(void) {
+	die("usage: %s [-n count] [-d delay] [st [argument ...]]\n", argv0);
+}
+
+Window
+findwindow(Display *dpy, Window w) {
+	Window root, parent, *children, found = None;
+	XClassHint hint;
+	unsigned int i, n;
+
+	if(XGetClassHint(dpy, w, &hint)) {
+		if(!strcmp(hint.res_class, CLASS))
+			found = w;
+		XFree(hint.res_name);
+		XFree(hint.res_class);
+		if(found)
+			return found;
+	}
+
+	if(!XQueryTree(dpy, w, &root, &parent, &children, &n))
+		return None;
+	for(i = 0; i < n && !found; i++)
+		found = findwindow(dpy, children[i]);
+	if(children)
+		XFree(children);
+
+	return found;
+}
+
+int
+main(int argc, char *argv[]) {
+	Display *dpy;
+	Window win = None;
+	KeyCode key, ret, k;
+	char **args;
+	pid_t pid;
+	int i, n, ev, err, major, minor;
+
+	ARGBEGIN {
+	case 'n':
+		count = atoi(EARGF(usage()));
+		break;
+	case 'd':
+		delay = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if(!(dpy = XOpenDisplay(NULL)))
+		die("%s: cannot open display\n", argv0);
+	if(!XTestQueryExtension(dpy, &ev, &err, &major, &minor))
+		die("%s: no XTest extension\n", argv0);
+
+	/* st -l -c CLASS [argument ...] -e cat */
+	args = calloc(argc + 7, sizeof(*args));
+	if(!args)
+		die("%s: out of memory\n", argv0);
+	n = 0;
+	args[n++] = argc > 0 ? argv[0] : "st";
+	args[n++] = "-l";
+	args[n++] = "-c";
+	args[n++] = CLASS;
+	for(i = 1; i < argc; i++)
+		args[n++] = argv[i];
+	args[n++] = "-e";
+	args[n++] = "cat";
+
+	switch(pid = fork()) {
+	case -1:
+		die("%s: fork failed\n", argv0);
+	case 0:
+		execvp(args[0], args);
+		die("%s: cannot run %s\n", argv0, args[0]);
+	}
+
+	for(i = 0; i < 100 && !win; i++) {
+		usleep(50000);
+		win = findwindow(dpy, DefaultRootWindow(dpy));
+	}
+	if(!win) {
+		kill(pid, SIGTERM);
+		die("%s: no st window showed up\n", argv0);
+	}
+
+	/* give cat time to start */
+	usleep(500000);
+	XSetInputFocus(dpy, win, RevertToParent, CurrentTime);
+	XSync(dpy, False);
+
+	key = XKeysymToKeycode(dpy, XK_a);
+	ret = XKeysymToKeycode(dpy, XK_Return);
+	for(i = 0; i < count; i++) {
+		k = i % 64 == 63 ? ret : key;
+		XTestFakeKeyEvent(dpy, k, True, CurrentTime);
+		XTestFakeKeyEvent(dpy, k, False, CurrentTime);
+		XFlush(dpy);
+		usleep(delay * 1000);
+	}
+
+	/* st only prints on exit or SIGUSR1, not when it is killed */
+	kill(pid, SIGUSR1);
+	usleep(200000);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	XCloseDisplay(dpy);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+# See LICENSE for licence details.
+#
+# Writes width.h, the number of cells every code point takes, from the
+# Unicode database of the python running it:
+#
+#	python3 mkwidth.py > width.h
+#
+# Combining marks and format characters take none, East Asian wide and
+# fullwidth characters two and everything else one.  The table has two
+# levels: widthidx picks the block of 256 code points, widthtab holds the
+# blocks with four 2-bit widths per byte.
+import unicodedata
+
+SHIFT = 8
+BLOCK = 1 << SHIFT
+END = 0x110000
+
+
+def width(u):
+    c = chr(u)
+    cat = unicodedata.category(c)
+    if u == 0:
+        return 0
+    if cat in ('Mn', 'Me') or (cat == 'Cf' and u != 0xad):
+        return 0
+    if 0x1160 <= u <= 0x11ff or u == 0x200b:
+        return 0
+    if unicodedata.east_asian_width(c) in ('W', 'F'):
+        return 2
+    return 1
+
+
+def pack(block):
+    return [block[i] | block[i + 1] << 2 | block[i + 2] << 4
+            | block[i + 3] << 6 for i in range(0, len(block), 4)]
+
+
+def array(values):
+    lines = []
+    for i in range(0, len(values), 16):
+        lines.append('\t' + ', '.join('%d' % v for v in values[i:i + 16])
+                     + ',')
+    return '\n'.join(lines)
+
+
+blocks = {}
+index = []
+for b in range(END >> SHIFT):
+    t = tuple(width(u) for u in range(b << SHIFT, (b + 1) << SHIFT))
+    index.append(blocks.setdefault(t, len(blocks)))
+
+print('/* Generated by mkwidth.py from Unicode %s, do not edit. */'
+      % unicodedata.unidata_version)
+print()
+print('static const unsigned char widthidx[%d] = {' % len(index))
+print(array(index))
+print('};')
+print()
+print('static const unsigned char widthtab[%d][%d] = {'
+      % (len(blocks), BLOCK // 4))
+for block in blocks:
+    print('{')
+    print(array(pack(block)))
+    print('},')
+print('};')
+print()
+print('/* cells code point u takes, see mkwidth.py */')
+print('#define WIDTH(u) ((u) < 0x%X ? widthtab[widthidx[(u) >> %d]]'
+      '[((u) & 0x%x) >> 2] >> ((u) & 3) * 2 & 3 : 1)'
+      % (END, SHIFT, BLOCK - 1))
@@ -4,15 +4,20 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -25,6 +30,14 @@
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
 #include <X11/Xft/Xft.h>
+#include <X11/extensions/XShm.h>
+#ifdef USE_PRESENT
+#include <X11/extensions/Xpresent.h>
+#endif
+#ifdef USE_HARFBUZZ
+#include <hb.h>
+#include <hb-ft.h>
+#endif
 #include <fontconfig/fontconfig.h>
 
 #include "arg.h"
@@ -67,7 +80,7 @@ char *argv0;
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
-#define DRAW_BUF_SIZ  20*1024
+#define DRAW_BUF_SIZ  4*1024
 #define XK_ANY_MOD    UINT_MAX
 #define XK_NO_MOD     0
 #define XK_SWITCH_MOD (1<<13)
@@ -82,9 +95,18 @@ char *argv0;
 #define DEFAULT(a, b)     (a) = (a) ? (a) : (b)
 #define BETWEEN(x, a, b)  ((a) <= (x) && (x) <= (b))
 #define LIMIT(x, a, b)    (x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
-#define ATTRCMP(a, b) ((a).mode != (b).mode || (a).fg != (b).fg || (a).bg != (b).bg)
+#define ISDIRTY(t, y) ((t)->dirty[y].x1 <= (t)->dirty[y].x2)
+#define ISSHOWN(t) ((t) == focused_term && (xw.state & WIN_VISIBLE))
+/* whether row y can have selected cells at all, see selected() */
+#define SELROW(y) (sel.bx != -1 && BETWEEN(y, sel.b.y, sel.e.y))
+/* box drawing and block elements, which xdrawbox() draws itself */
+#define ISBOX(u) (boxdraw && BETWEEN(u, 0x2500, 0x259f))
 #define IS_SET(t, flag) (((t)->mode & (flag)) != 0)
+/* whether the tab bar takes the row below the terminal */
+#define BARSHOWN (!autohide || terms->next)
 #define TIMEDIFF(t1, t2) ((t1.tv_sec-t2.tv_sec)*1000 + (t1.tv_usec-t2.tv_usec)/1000)
+/* the nearest of the six levels of the 256 colour cube */
+#define CUBE(v) ((v) < 48 ? 0 : (v) < 115 ? 1 : ((v) - 35) / 40)
 
 #define VT102ID "\033[?6c"
 
@@ -99,6 +121,8 @@ enum glyph_attribute {
 	ATTR_ITALIC    = 16,
 	ATTR_BLINK     = 32,
 	ATTR_WRAP      = 64,
+	ATTR_WIDE      = 128,	/* takes this cell and the next */
+	ATTR_WDUMMY    = 256,	/* the second cell of a wide character */
 };
 
 enum cursor_movement {
@@ -130,6 +154,7 @@ enum term_mode {
 	MODE_8BIT	 = 8192,
 	MODE_BLINK	 = 16384,
 	MODE_FBLINK	 = 32768,
+	MODE_SYNC	 = 65536,
 };
 
 enum escape_state {
@@ -166,17 +191,57 @@ typedef unsigned int uint;
 typedef unsigned long ulong;
 typedef unsigned short ushort;
 
+/*
+ * With CLUSTER set, Glyph.u is not a code point but the index of an
+ * extended grapheme cluster in Term.clusters.
+ */
+#define CLUSTER (1U << 31)
+#define CLUSTERLEN 16		/* code points a cluster takes at most */
+#define CLUSTERMAX (1 << 20)	/* clusters a tab keeps at most */
+
 typedef struct {
-	char c[UTF_SIZ];     /* character code */
-	uchar mode;  /* attribute flags */
+	uint32_t u;  /* character code point */
+	ushort mode; /* attribute flags */
 	ushort fg;   /* foreground  */
 	ushort bg;   /* background  */
 } Glyph;
 
-typedef Glyph *Line;
+/*
+ * A line keeps its cells as three arrays, one after another: the code
+ * points, the colour pairs (fg | bg << 16) and the modes, followed by its
+ * Palette.  So line[x] is the Glyph.u of a cell; runs and clears go over
+ * the other arrays with LINECOL() and LINEMODE().
+ */
+typedef uint32_t *Line;
+
+/*
+ * 24-bit colours of a line, kept behind its glyphs.  A Glyph.fg or bg with
+ * TRUECOL set is a slot of it.  It also sums up the modes of the glyphs,
+ * so that finding the blinking ones need not look at every cell.
+ */
+#define PALSIZ 16
+#define TRUECOL 0x8000
+#define TCOLWAYS 8	/* colours per set of the cache, see xtruecolour() */
+
+typedef struct {
+	uchar rgb[PALSIZ][3];
+	uchar n;	/* slots taken */
+	ushort mode;	/* a glyph may have these, see tlineattr() */
+} Palette;
+
+#define LINESIZ(col) ((col) * (2 * sizeof(uint32_t) + sizeof(ushort)) \
+		+ sizeof(Palette))
+#define LINECOL(line, col) ((line) + (col))
+#define LINEMODE(line, col) ((ushort *)((line) + 2 * (col)))
+#define LINEPAL(line, col) ((Palette *)(LINEMODE(line, col) + (col)))
+#define COLPAIR(g) ((g).fg | (uint32_t)(g).bg << 16)
+/* the modes of row y of term t */
+#define TMODE(t, y) LINEMODE((t)->line[y], (t)->col)
 
 typedef struct {
 	Glyph attr;	 /* current char attributes */
+	uint32_t fgrgb;	 /* the colours of a TRUECOL attr */
+	uint32_t bgrgb;
 	int x;
 	int y;
 	char state;
@@ -204,13 +269,38 @@ typedef struct {
 	int narg;	      /* nb of args */
 } STREscape;
 
+/* A character and the marks combined with it, see tcombine() */
+typedef struct {
+	uint32_t *u;	/* NULL if free */
+	int n;
+	bool mark;	/* a cell names it, see tsweep() */
+} Cluster;
+
+/* Columns of a line that have to be painted again, none if x1 > x2 */
+typedef struct {
+	int x1, x2;
+} Dirty;
+
+/* Cells that were shifted by dx, dy since the last frame */
+typedef struct {
+	int x1, y1, x2, y2;
+	int dx, dy;
+} Move;
+
+/* The last samples of a measured duration, see statprint() */
+typedef struct {
+	const char *name;
+	uint64_t sample[1024];	/* in microseconds */
+	unsigned long n;
+} Stat;
+
 /* Internal representation of the screen */
 typedef struct _Term {
 	int row;	/* nb row */
 	int col;	/* nb col */
 	Line *line;	/* screen */
 	Line *alt;	/* alternate screen */
-	bool *dirty;	/* dirtyness of lines */
+	Dirty *dirty;	/* dirtyness of lines */
 	TCursor c;	/* cursor */
 	int top;	/* top    scroll limit */
 	int bot;	/* bottom scroll limit */
@@ -228,10 +318,20 @@ typedef struct _Term {
 	Line *last_line;
 	bool has_activity;
 	char *title;
-#ifdef OPTIMIZE_RENDER
-	ssize_t last_ret;
-	bool swapped_lines;
-#endif
+	Move moves[16];	/* shifts not yet copied on the screen */
+	int nmoves;
+	uint64_t syncstart; /* when a synchronized update began */
+	bool stale;	/* changed while not shown, see tsetdirt() */
+	uint64_t nextread; /* when to read again while not shown */
+	char rbuf[BUFSIZ]; /* read and not parsed yet */
+	int rbuflen;
+	Pixmap buf;	/* its screen while another tab is shown */
+	int bufcurx, bufcury; /* where the cursor is drawn in it */
+	unsigned long bufused; /* when it was last shown */
+	Cluster *clusters; /* what cells with CLUSTER name */
+	int ncluster, nclusterused;
+	int *clusterhash; /* 2 * ncluster indices into clusters, -1 if none */
+	int nblink; /* lines with ATTR_BLINK in their Palette.mode */
 } Term;
 
 /* Purely graphic info */
@@ -253,6 +353,10 @@ typedef struct {
 	int ch; /* char height */
 	int cw; /* char width  */
 	char state; /* focus, redraw, visible */
+	int curx, cury; /* cell the cursor was last drawn in */
+	XRectangle clip; /* of the drawing primitives, empty if none */
+	XRectangle damage[32]; /* drawn since the last present */
+	int ndamage;
 } XWindow;
 
 typedef struct {
@@ -305,11 +409,13 @@ typedef struct {
 /* function definitions used in config.h */
 static void clippaste(const Arg *);
 static void numlock(const Arg *);
+static void togglelatency(const Arg *);
 static void selpaste(const Arg *);
 static void xzoom(const Arg *);
 
 /* Config.h for applying patches and the configuration. */
 #include "config.h"
+#include "width.h"
 
 /* Font structure */
 typedef struct {
@@ -322,12 +428,42 @@ typedef struct {
 	XftFont *match;
 	FcFontSet *set;
 	FcPattern *pattern;
+	/*
+	 * Coverage of the matched font: one 256 bit page per high byte of
+	 * the BMP and a sorted sparse list of pages above it.
+	 */
+	const FcChar32 *bmp[256];
+	FcChar32 *astral;
+	FcChar32 *astralbase;
+	int nastral;
+	bool ascii; /* covers all of printable ASCII */
+#ifdef USE_HARFBUZZ
+	hb_font_t *hb; /* keeps the face of match locked, see xshape() */
+#endif
 } Font;
 
+/*
+ * Fonts of one pixel size, indexed by FRC_*. Only the regular font is
+ * loaded up front, the other styles are loaded the first time they are
+ * drawn.
+ */
+typedef struct {
+	int size;
+	FcPattern *pattern;
+	Font font[4];
+	bool loaded[4];
+	bool failed[4];	/* could not be loaded, FRC_NORMAL stands in */
+	unsigned long used;
+} Fontsize;
+
+#define NCOLS (LEN(colorname) < 256 ? 256 : LEN(colorname))
+
 /* Drawing Context */
 typedef struct {
-	Colour col[LEN(colorname) < 256 ? 256 : LEN(colorname)];
-	Font font, bfont, ifont, ibfont;
+	Colour col[NCOLS];
+	Colour rev[NCOLS];	/* col inverted, for reverse video */
+	ushort bright[NCOLS];	/* index of the bold variant of a colour */
+	Fontsize *fonts; /* current size */
 	GC gc;
 } DC;
 
@@ -353,7 +489,7 @@ static void strhandle(Term *);
 static void strparse(void);
 static void strreset(void);
 
-static int tattrset(Term *, int);
+static void tblinkcount(Term *);
 static void tclearregion(Term *, int, int, int, int);
 static void tcursor(Term *, int);
 static void tdeletechar(Term *, int);
@@ -365,16 +501,32 @@ static void tmoveato(Term *, int x, int y);
 static void tnew(Term *, int, int);
 static void tnewline(Term *, int);
 static void tputtab(Term *, bool);
-static void tputc(Term *, char *, int);
+static void tputc(Term *, long);
 static void treset(Term *);
 static int tresize(Term *, int, int);
 static void tscrollup(Term *, int, int);
 static void tscrolldown(Term *, int, int);
 static void tsetattr(Term *, int*, int);
-static void tsetchar(Term *, char *, Glyph *, int, int);
+static void tsetchar(Term *, long, Glyph *, int, int);
+static void tsplitwide(Term *, int, int, int);
+static void tcombine(Term *, int, int, uint32_t);
+static uint32_t tintern(Term *, uint32_t *, int);
+static void tsweep(Term *);
+static void tclusterindex(Term *);
+static uint32_t clusterhash(uint32_t *, int);
+static Glyph tlineattr(Term *, Glyph *, int);
+static ushort tpalette(Term *, int, uint32_t, uint);
+static Line lresize(Line, int, int);
+static Glyph lget(Line, int, int);
+static void lset(Line, int, int, Glyph *);
+static void lmove(Line, int, int, int, int);
+static bool lmatch(Line, int, int, uint32_t *, int);
 static void tsetscroll(Term *, int, int);
 static void tswapscreen(Term *);
 static void tsetdirt(Term *, int, int);
+static void tsetdirtspan(Term *, int, int, int);
+static void tsync(Term *, bool);
+static void tmove(Term *, int, int, int, int, int, int);
 static void tsetdirtattr(Term *, int);
 static void tsetmode(Term *, bool, bool, int *, int);
 static void tfulldirt(Term *);
@@ -384,6 +536,7 @@ static void tscrollback(Term *term, int n);
 static inline bool match(uint, uint);
 static void ttynew(Term *);
 static int ttyread(Term *);
+static int ttyreadbatch(Term *);
 static void ttyresize(Term *);
 static void ttywrite(Term *, const char *, size_t);
 
@@ -394,26 +547,91 @@ static void term_focus_prev(Term *);
 static void term_focus_next(Term *);
 static void term_focus_idx(int);
 
-static void xdraws(char *, Glyph, int, int, int, int);
+static void xdraws(uint32_t *, Glyph, Palette *, int, int, int);
 static void xhints(void);
 static void xclear(int, int, int, int);
 static void xdrawcursor(void);
 static void xinit(void);
 static void xloadcols(void);
+static int xloadrev(int);
+static Colour *xcolour(ushort, Palette *, bool);
+static Colour *xtruecolour(uint32_t);
+static int xsetcolor(int, Colour *);
 static int xsetcolorname(int, const char *);
 static int xloadfont(Font *, FcPattern *);
+static void xloadcoverage(Font *);
+static void xunloadcoverage(Font *);
+static inline bool xfonthas(Font *, long);
 static void xloadfonts(char *, int);
+static Font *xgetfont(int);
 static int xloadfontset(Font *);
+static int frcadd(XftFont *, long, int, int);
+static FcPattern *xfallbackmatch(FcPattern *, FcFontSet *, long);
+static void xfallbackinit(void);
+static int xfallbackqueue(Font *, long, int, int);
+static void xfallbackpoll(void);
+static void fcacheload(void);
+static XftFont *fcachefind(Font *, long, int);
+static void fcacherecord(long, int, FcPattern *);
+static void fcachesave(void);
 static void xsettitle(char *);
 static void xresettitle(void);
 static void xseturgency(int);
 static void xsetsel(char*);
 static void xtermclear(int, int, int, int);
 static void xunloadfont(Font *f);
-static void xunloadfonts(void);
+static void xunloadfonts(Fontsize *);
 static void xresize(int, int);
 static void xdrawbar(void);
+static void xrenderbar(void);
+static int xedge(int);
+static void xdrawbarstr(char *, int, Glyph, int);
+static void barchanged(void);
+static int entrydecode(uint32_t *);
 static void xmove(int, int, int, int, int, int);
+static void drawmoves(void);
+static void xdrawrect(Colour *, int, int, int, int);
+static void xdrawrects(Colour *, XRectangle *, int);
+static bool xdamagerects(XRectangle *, int);
+static void xdrawshades(Colour *, int, XRectangle *, int);
+static void xdrawbox(Colour *, int, int, int, int, uint32_t);
+static void boxlines(int, int, int, int, uint);
+static void boxline(bool, int, int, int, int, int, int);
+static void boxrect(int, int, int, int);
+static void boxflush(void);
+static void xdrawtext(Colour *, XftFont *, int, int, uint32_t *, int);
+static void xdrawrun(Colour *, Font *, int, int, uint32_t *, int);
+static void xsetclip(int, int, int, int);
+static void xcopy(int, int, int, int, int, int);
+static void xpresent(int, int, int, int);
+static void xdamage(int, int, int, int);
+static void xpresentdamage(void);
+static bool xswapbuf(Term *);
+static void xfreebufs(void);
+static uint64_t xrowhash(int, bool, uint64_t *);
+static bool xrowload(uint64_t, uint64_t, int);
+static void xrowsave(uint64_t, uint64_t, int);
+#ifdef USE_PRESENT
+static void presentinit(void);
+static void presentevent(XEvent *);
+static bool presentdue(struct timeval *);
+#endif
+static int xevents(void);
+static uint64_t monotime(void);
+static void statadd(Stat *, uint64_t);
+static void statprint(Stat *);
+static void stats(void);
+static void probekey(int);
+static void sigstats(int);
+
+static bool swinit(int, int);
+static bool swresize(int, int);
+static void swfree(void);
+static void swrect(ulong, int, int, int, int);
+static void swshade(ulong, int, int, int, int, int);
+static void swcopy(int, int, int, int, int, int);
+static void swtext(ulong, XftFont *, int, int, uint32_t *, int);
+static void swflushglyphs(void);
 
 #ifdef USE_BLANK_CURSOR
 static void xcursorblank(void);
@@ -442,12 +660,11 @@ static void selcopy(void);
 static void selscroll(Term *, int, int);
 static void selsnap(int, int *, int *, int);
 
-static Glyph *scrollback_get(Term *, int);
+static Line scrollback_get(Term *, int);
 static void scrollback_add(Term *, int);
 
 static int utf8decode(char *, long *);
 static int utf8encode(long *, char *);
-static int utf8size(char *);
 static int isfullutf8(char *, int);
 
 static ssize_t xwrite(int, char *, size_t);
@@ -472,11 +689,39 @@ static void (*handler[LASTEvent])(XEvent *) = {
 	[SelectionClear] = selclear,
 	[SelectionNotify] = selnotify,
 	[SelectionRequest] = selrequest,
+#ifdef USE_PRESENT
+	[GenericEvent] = presentevent,
+#endif
 };
 
+/* Software renderer state, see swinit() */
+typedef struct {
+	XftFont *font;
+	FT_UInt index;
+	short left, top;	/* bitmap offset from the pen position */
+	short advance;
+	ushort w, h;
+	uchar *alpha;
+	uint32_t *argb;	/* colour glyphs instead, premultiplied */
+} Swglyph;
+
+typedef struct {
+	XImage *img;
+	XShmSegmentInfo info;
+	bool useshm;	/* else the image is sent with XPutImage */
+	bool busy;	/* the server may still read the image */
+	bool failed;
+	int byteorder;
+} Softrender;
+
+static Swglyph swglyphs[4096];
+static int nswglyphs = 0;
+static void swcolourglyph(Swglyph *, FT_Bitmap *, double);
+
 /* Globals */
 static DC dc;
 static XWindow xw;
+static Softrender sw;
 static Term *terms;
 static Term *focused_term;
 enum tstate_t {
@@ -496,6 +741,9 @@ static struct timeval last_getproc;
 #endif
 static struct { int flag; char text[60]; int pos; } entry;
 static int clicked_bar = -1;
+static unsigned long bargen = 1, bardrawn; /* bumped when the bar changes */
+static Pixmap barpix;	/* the bar as last drawn, None if not kept */
+static bool barlost;	/* the back buffer lost the bar, see xdrawbar() */
 static CSIEscape csiescseq;
 static STREscape strescseq;
 static pid_t pid;
@@ -530,6 +778,7 @@ typedef struct {
 	XftFont *font;
 	long c;
 	int flags;
+	int size;
 } Fontcache;
 
 /*
@@ -540,6 +789,227 @@ typedef struct {
 static Fontcache frc[1024];
 static int frccur = -1, frclen = 0;
 
+/*
+ * The arms of U+2500 to U+257F, two bits each for left, up, right and
+ * down, which are BOX_LIGHT, BOX_HEAVY, BOX_DOUBLE or none, and the
+ * number of dashes above them.  The diagonals have none.
+ */
+enum { BOX_LIGHT = 1, BOX_HEAVY, BOX_DOUBLE };
+
+static const ushort boxarms[128] = {
+	0x011, 0x022, 0x044, 0x088, 0x311, 0x322, 0x344, 0x388,
+	0x411, 0x422, 0x444, 0x488, 0x050, 0x060, 0x090, 0x0a0,
+	0x041, 0x042, 0x081, 0x082, 0x014, 0x024, 0x018, 0x028,
+	0x005, 0x006, 0x009, 0x00a, 0x054, 0x064, 0x058, 0x094,
+	0x098, 0x068, 0x0a4, 0x0a8, 0x045, 0x046, 0x049, 0x085,
+	0x089, 0x04a, 0x086, 0x08a, 0x051, 0x052, 0x061, 0x062,
+	0x091, 0x092, 0x0a1, 0x0a2, 0x015, 0x016, 0x025, 0x026,
+	0x019, 0x01a, 0x029, 0x02a, 0x055, 0x056, 0x065, 0x066,
+	0x059, 0x095, 0x099, 0x05a, 0x069, 0x096, 0x0a5, 0x06a,
+	0x0a6, 0x09a, 0x0a9, 0x0aa, 0x211, 0x222, 0x244, 0x288,
+	0x033, 0x0cc, 0x070, 0x0d0, 0x0f0, 0x043, 0x0c1, 0x0c3,
+	0x034, 0x01c, 0x03c, 0x007, 0x00d, 0x00f, 0x074, 0x0dc,
+	0x0fc, 0x047, 0x0cd, 0x0cf, 0x073, 0x0d1, 0x0f3, 0x037,
+	0x01d, 0x03f, 0x077, 0x0dd, 0x0ff, 0x050, 0x041, 0x005,
+	0x014, 0x000, 0x000, 0x000, 0x001, 0x004, 0x010, 0x040,
+	0x002, 0x008, 0x020, 0x080, 0x021, 0x084, 0x012, 0x048,
+};
+
+/* U+2596 to U+259F, one bit each for the upper left, upper right, lower
+ * left and lower right quadrant */
+static const uchar boxquads[10] = { 4, 8, 1, 13, 9, 7, 11, 2, 6, 14 };
+
+/*
+ * Rectangles xdrawbox() has yet to fill, all in one colour, and the cells
+ * of the shades U+2591 to U+2593, each filled with its 2x2 pattern
+ */
+static struct {
+	XRectangle r[512];
+	int n;
+	XRectangle shade[3][128];
+	int nshade[3];
+	Colour *c;
+} boxes;
+
+/* the shade patterns, a byte per row, and their stipples for the GC */
+static const uchar shadebits[3][2] = { { 1, 0 }, { 1, 2 }, { 3, 1 } };
+static Pixmap shadestipple[3];
+static GC shadegc;
+
+/* Recently used font sizes, so zooming back and forth does not reload */
+static Fontsize fontsizes[8];
+static unsigned long fontsizeuse = 0;
+
+/* Fallback fonts resolved by a worker thread, see xfallbackwork() */
+enum {
+	FB_QUEUED,
+	FB_RUNNING,
+	FB_DONE,
+	FB_FAILED
+};
+
+typedef struct Fallback {
+	long c;
+	int flags;
+	int size;	/* font size the request was made for */
+	int state;
+	FcPattern *pattern; /* the request, then the match */
+	struct Fallback *next;
+} Fallback;
+
+static Fallback *fallbacks = NULL;
+
+/*
+ * Lookups that found no font, so they are not queued again.  One key per
+ * slot, a newer one pushes out an older one; that is only retried.
+ */
+static uint64_t fbfailed[4096];
+#define FBKEY(c, flags, size) \
+	((uint64_t)(size) << 32 | (uint64_t)(flags) << 24 | (c))
+#define FBSLOT(key) ((key) * 0x9e3779b97f4a7c15ULL >> 52)
+static pthread_mutex_t fblock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fbcond = PTHREAD_COND_INITIALIZER;
+static int fbpipe[2] = { -1, -1 };
+
+/*
+ * On-disk cache of resolved fallback fonts, so a new st does not have to
+ * ask fontconfig again. The file is mapped as is: a header, the ranges
+ * sorted by style and first code point, a table of offsets into the
+ * file names and the NUL terminated file names.
+ */
+#define FCACHE_MAGIC   0x63667473 /* "stfc" */
+#define FCACHE_VERSION 1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t nranges;
+	uint32_t nfiles;
+} FcacheHeader;
+
+typedef struct {
+	uint32_t lo, hi;	/* code point range */
+	uint32_t flags;		/* FRC_* style */
+	uint32_t file;		/* index into the file table */
+	int32_t index;		/* face index in the file */
+} FcacheRange;
+
+typedef struct {
+	long lo, hi;
+	int flags;
+	int index;
+	char *file;
+} FcacheEntry;
+
+static struct {
+	char *path;
+	uint64_t key;
+	void *map;
+	size_t maplen;
+	const FcacheRange *ranges;
+	const uint32_t *files;
+	uint32_t nranges, nfiles;
+	FcacheEntry *added;
+	int nadded;
+	pid_t owner;
+} fcache;
+
+static Stat framestat = { "frame interval" };
+static uint64_t lastframe;
+static pid_t statowner;
+static uint64_t lastkey;	/* when a key was last sent to a tty */
+static unsigned long bufuse;	/* counter for Term.bufused */
+static volatile sig_atomic_t statsrequested;
+
+/* 24-bit colours allocated for drawing, see xtruecolour() */
+static struct {
+	uint32_t rgb;
+	Colour col;
+	unsigned long used;	/* 0 if free */
+} *tcols;
+static int ntcolsets;
+static struct {
+	unsigned long hits, misses, quantized, tick;
+} tcolstat;
+
+/*
+ * Rows drawn lately, as strips of one pixmap so that drawing one again
+ * is a copy, see xrowload().  A row is only kept when it is drawn a
+ * second time, so that output streaming past does not fill it.
+ */
+static struct {
+	Pixmap pix;	/* None until a row is kept */
+	int n;		/* strips in pix */
+	struct {
+		uint64_t hash; /* 0 if free */
+		uint64_t check; /* a second hash, see xrowhash() */
+		unsigned long used;
+	} *strip;
+	uint64_t *seen;	/* rows drawn once, a ring of n */
+	int nseen;
+	bool nokeep;	/* the row being drawn shows a placeholder */
+	unsigned long hits, misses, tick;
+} rows;
+
+/* How long after a key press it was written, echoed, drawn and shown */
+enum { KEY_WRITE, KEY_READ, KEY_DRAW, KEY_FLUSH, KEY_SHOWN };
+
+static Stat keystat[] = {
+	[KEY_WRITE] = { "key to ttywrite" },
+	[KEY_READ]  = { "key to ttyread" },
+	[KEY_DRAW]  = { "key to draw" },
+	[KEY_FLUSH] = { "key to flush" },
+	[KEY_SHOWN] = { "key to vblank" },
+};
+
+/* The key press followed through keystat, one at a time */
+static struct {
+	uint64_t key;	/* when it was pressed, 0 if none */
+	Term *term;	/* it was sent to */
+	int stage;	/* the last one reached */
+	uint32_t serial; /* of the Present frame showing it */
+} keyprobe;
+
+#ifdef USE_HARFBUZZ
+/* Runs of text shaped by HarfBuzz, see xshape() */
+#define SHAPEWAYS 4
+#define SHAPESETS 256
+
+typedef struct {
+	XftFont *font;	/* NULL if free */
+	uint32_t hash;
+	uint32_t *text;
+	int len;
+	XftGlyphSpec *glyphs; /* from the start of the run */
+	int nglyphs;
+	unsigned long used;
+} Shaped;
+
+static Shaped shaped[SHAPESETS * SHAPEWAYS];
+static struct {
+	unsigned long hits, misses, tick;
+} shapestat;
+static Stat shapetime = { "shaping" };
+static hb_buffer_t *hbbuf;
+
+static void xdrawglyphs(Colour *, XftFont *, int, int, XftGlyphSpec *, int);
+static Shaped *xshape(Font *, uint32_t *, int);
+static void xshapeflush(XftFont *);
+#endif
+
+#ifdef USE_PRESENT
+/* Frames shown on vblank through the Present extension */
+static struct {
+	int opcode;		/* of the extension, 0 if unavailable */
+	uint32_t serial;	/* of the last frame sent */
+	bool busy;		/* the server still uses the back buffer */
+	uint64_t sent;		/* when the last frame was sent */
+	uint64_t ust, msc;	/* when and at which vblank it was shown */
+	uint64_t refresh;	/* microseconds between vblanks */
+} present;
+#endif
+
 ssize_t
 xwrite(int fd, char *s, size_t len) {
 	size_t aux = len;
@@ -582,6 +1052,99 @@ xcalloc(size_t nmemb, size_t size) {
 	return p;
 }
 
+/* Microseconds on the clock Present timestamps vblanks with. */
+uint64_t
+monotime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void
+statadd(Stat *st, uint64_t us) {
+	st->sample[st->n++ % LEN(st->sample)] = us;
+}
+
+int
+statcmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+void
+statprint(Stat *st) {
+	uint64_t s[LEN(st->sample)], sum = 0;
+	int i, n = MIN(st->n, LEN(st->sample));
+
+	if(!n)
+		return;
+
+	memcpy(s, st->sample, n * sizeof(*s));
+	qsort(s, n, sizeof(*s), statcmp);
+	for(i = 0; i < n; i++)
+		sum += s[i];
+
+	fprintf(stderr, "%s: %lu, avg %.2fms, p50 %.2fms, p99 %.2fms,"
+			" max %.2fms\n", st->name, st->n,
+			sum / 1000.0 / n, s[n/2] / 1000.0,
+			s[n * 99 / 100] / 1000.0, s[n-1] / 1000.0);
+}
+
+/* Record that the followed key press reached stage, see keystat. */
+void
+probekey(int stage) {
+	if(!keyprobe.key || keyprobe.stage != stage - 1)
+		return;
+
+	statadd(&keystat[stage], monotime() - keyprobe.key);
+	keyprobe.stage = stage;
+}
+
+void
+stats(void) {
+	int i;
+
+	/* not from children that failed to exec */
+	if(getpid() != statowner)
+		return;
+
+	statprint(&framestat);
+	for(i = 0; i < LEN(keystat); i++)
+		statprint(&keystat[i]);
+
+	if(tcolstat.hits + tcolstat.misses + tcolstat.quantized) {
+		fprintf(stderr, "24-bit colours: %lu hits, %lu allocations,"
+				" %lu cells quantized, %zu bytes per line\n",
+				tcolstat.hits, tcolstat.misses,
+				tcolstat.quantized, sizeof(Palette));
+	}
+	if(rows.hits + rows.misses) {
+		fprintf(stderr, "row cache: %lu hits, %lu misses,"
+				" %.1f%% hit rate, %lu bytes\n",
+				rows.hits, rows.misses,
+				100.0 * rows.hits / (rows.hits + rows.misses),
+				rows.pix ? (unsigned long)rows.n * xw.w * xw.ch
+				* 4 : 0);
+	}
+#ifdef USE_HARFBUZZ
+	if(shapestat.hits + shapestat.misses) {
+		fprintf(stderr, "shaped runs: %lu hits, %lu misses,"
+				" %.1f%% hit rate\n",
+				shapestat.hits, shapestat.misses,
+				100.0 * shapestat.hits
+				/ (shapestat.hits + shapestat.misses));
+	}
+	statprint(&shapetime);
+#endif
+}
+
+void
+sigstats(int unused) {
+	statsrequested = 1;
+}
+
 int
 utf8decode(char *s, long *u) {
 	uchar c;
@@ -691,21 +1254,6 @@ isfullutf8(char *s, int b) {
 	}
 }
 
-int
-utf8size(char *s) {
-	uchar c = *s;
-
-	if(~c&B7) {
-		return 1;
-	} else if((c&(B7|B6|B5)) == (B7|B6)) {
-		return 2;
-	} else if((c&(B7|B6|B5|B4)) == (B7|B6|B5)) {
-		return 3;
-	} else {
-		return 4;
-	}
-}
-
 void
 selinit(void) {
 	memset(&sel.tclick1, 0, sizeof(sel.tclick1));
@@ -757,6 +1305,7 @@ selected(int x, int y) {
 
 void
 selsnap(int mode, int *x, int *y, int direction) {
+	uint32_t c;
 	int i;
 
 	switch(mode) {
@@ -767,7 +1316,7 @@ selsnap(int mode, int *x, int *y, int direction) {
 		 */
 		for(;;) {
 			if(direction < 0 && *x <= 0) {
-				if(*y > 0 && focused_term->line[*y - 1][focused_term->col-1].mode
+				if(*y > 0 && TMODE(focused_term, *y - 1)[focused_term->col-1]
 						& ATTR_WRAP) {
 					*y -= 1;
 					*x = focused_term->col-1;
@@ -776,7 +1325,7 @@ selsnap(int mode, int *x, int *y, int direction) {
 				}
 			}
 			if(direction > 0 && *x >= focused_term->col-1) {
-				if(*y < focused_term->row-1 && focused_term->line[*y][*x].mode
+				if(*y < focused_term->row-1 && TMODE(focused_term, *y)[*x]
 						& ATTR_WRAP) {
 					*y += 1;
 					*x = 0;
@@ -785,8 +1334,8 @@ selsnap(int mode, int *x, int *y, int direction) {
 				}
 			}
 
-			if(strchr(worddelimiters,
-					focused_term->line[*y][*x + direction].c[0])) {
+			c = focused_term->line[*y][*x + direction];
+			if(c < 0x80 && strchr(worddelimiters, c)) {
 				break;
 			}
 
@@ -802,14 +1351,14 @@ selsnap(int mode, int *x, int *y, int direction) {
 		*x = (direction < 0) ? 0 : focused_term->col - 1;
 		if(direction < 0 && *y > 0) {
 			for(; *y > 0; *y += direction) {
-				if(!(focused_term->line[*y-1][focused_term->col-1].mode
+				if(!(TMODE(focused_term, *y-1)[focused_term->col-1]
 						& ATTR_WRAP)) {
 					break;
 				}
 			}
 		} else if(direction > 0 && *y < focused_term->row-1) {
 			for(; *y < focused_term->row; *y += direction) {
-				if(!(focused_term->line[*y][focused_term->col-1].mode
+				if(!(TMODE(focused_term, *y)[focused_term->col-1]
 						& ATTR_WRAP)) {
 					break;
 				}
@@ -822,7 +1371,7 @@ selsnap(int mode, int *x, int *y, int direction) {
 		 */
 		if(direction > 0) {
 			i = focused_term->col;
-			while(--i > 0 && focused_term->line[*y][i].c[0] == ' ')
+			while(--i > 0 && focused_term->line[*y][i] == ' ')
 				/* nothing */;
 			if(i > 0 && i < *x)
 				*x = focused_term->col - 1;
@@ -990,33 +1539,49 @@ bpress(XEvent *e) {
 void
 selcopy(void) {
 	char *str, *ptr;
-	int x, y, bufsize, size, i, ex;
-	Glyph *gp, *last;
+	int x, y, bufsize, i, ex, last;
+	uint32_t *gp;
+	ushort *mp;
+	Cluster *cl;
+	long u;
 
 	// TODO: Handle selection grabbing across scrollback.
 
 	if(sel.bx == -1) {
 		str = NULL;
 	} else {
-		bufsize = (focused_term->col+1) * (sel.e.y-sel.b.y+1) * UTF_SIZ;
+		bufsize = (focused_term->col+1) * (sel.e.y-sel.b.y+1) * UTF_SIZ
+			* CLUSTERLEN;
 		ptr = str = xmalloc(bufsize);
 
 		/* append every set & selected glyph to the selection */
 		for(y = sel.b.y; y < sel.e.y + 1; y++) {
-			gp = &focused_term->line[y][0];
-			last = gp + focused_term->col;
+			gp = focused_term->line[y];
+			mp = TMODE(focused_term, y);
+			last = focused_term->col;
 
-			while(--last >= gp && !(selected(last - gp, y) && \
-						strcmp(last->c, " ") != 0))
+			while(--last >= 0 && !(selected(last, y) && \
+						gp[last] != ' '))
 				/* nothing */;
 
-			for(x = 0; gp <= last; x++, ++gp) {
-				if(!selected(x, y))
+			for(x = 0; x <= last; x++) {
+				/* a wide character half selected is copied */
+				if(mp[x] & ATTR_WDUMMY || !(selected(x, y)
+						|| (mp[x] & ATTR_WIDE
+						&& selected(x+1, y)))) {
 					continue;
+				}
 
-				size = utf8size(gp->c);
-				memcpy(ptr, gp->c, size);
-				ptr += size;
+				if(gp[x] & CLUSTER) {
+					cl = &focused_term->clusters[gp[x] & ~CLUSTER];
+					for(i = 0; i < cl->n; i++) {
+						u = cl->u[i];
+						ptr += utf8encode(&u, ptr);
+					}
+				} else {
+					u = gp[x];
+					ptr += utf8encode(&u, ptr);
+				}
 			}
 
 			/*
@@ -1028,7 +1593,7 @@ selcopy(void) {
 			 * st.
 			 * FIXME: Fix the computer world.
 			 */
-			if(y < sel.e.y && !((gp-1)->mode & ATTR_WRAP))
+			if(y < sel.e.y && !(x > 0 && mp[x-1] & ATTR_WRAP))
 				*ptr++ = '\n';
 
 			/*
@@ -1037,7 +1602,7 @@ selcopy(void) {
 			 */
 			if(y == sel.e.y) {
 				i = focused_term->col;
-				while(--i > 0 && focused_term->line[y][i].c[0] == ' ')
+				while(--i > 0 && focused_term->line[y][i] == ' ')
 					/* nothing */;
 				ex = sel.e.x;
 				if(sel.b.y == sel.e.y && sel.e.x < sel.b.x)
@@ -1176,7 +1741,7 @@ brelease(XEvent *e) {
 			selcopy();
 		}
 		sel.mode = 0;
-		focused_term->dirty[sel.ey] = 1;
+		tsetdirt(focused_term, sel.ey, sel.ey);
 	}
 }
 
@@ -1342,16 +1907,15 @@ dump(char c) {
 
 int
 ttyread(Term *term) {
-	static char buf[BUFSIZ];
-	static int buflen = 0;
+	char *buf = term->rbuf;
+	int buflen = term->rbuflen;
 	char *ptr;
-	char s[UTF_SIZ];
 	int charsize; /* size of utf8 char in bytes */
-	long utf8c;
+	long u;
 	int ret;
 
 	/* append read bytes to unprocessed bytes */
-	if((ret = read(term->cmdfd, buf+buflen, LEN(buf)-buflen)) < 0) {
+	if((ret = read(term->cmdfd, buf+buflen, LEN(term->rbuf)-buflen)) < 0) {
 #ifdef NO_TABS
 		die("Couldn't read from shell: %s\n", SERRNO);
 #else
@@ -1365,13 +1929,10 @@ ttyread(Term *term) {
 	// TODO: Potentially buffer data here:
 	// if (...) xrealloc(select_buf, (select_buf_size *= 2));
 
-#ifdef OPTIMIZE_RENDER
-	term->last_ret = ret;
-#endif
-
 	/* mark activity */
-	if (showactivity && focused_term != term) {
+	if (showactivity && focused_term != term && !term->has_activity) {
 		term->has_activity = true;
+		bargen++;
 	}
 
 	/* scroll down if we receive bytes while examining scrollback */
@@ -1383,17 +1944,45 @@ ttyread(Term *term) {
 	buflen += ret;
 	ptr = buf;
 	while(buflen >= UTF_SIZ || isfullutf8(ptr,buflen)) {
-		charsize = utf8decode(ptr, &utf8c);
-		utf8encode(&utf8c, s);
-		tputc(term, s, charsize);
+		charsize = utf8decode(ptr, &u);
+		tputc(term, u);
 		ptr += charsize;
 		buflen -= charsize;
 	}
 
 	/* keep any uncomplete utf8 char for the next call */
 	memmove(buf, ptr, buflen);
+	term->rbuflen = buflen;
 
-	return 0;
+	return ret;
+}
+
+/*
+ * Read a tab that is not on the screen in one go, up to bgbatch bytes or
+ * its share of the frame, so that it takes little time from the one that
+ * is shown.  While that one is busy, it is not read again for 1/bgfps s.
+ */
+int
+ttyreadbatch(Term *term) {
+	uint64_t start = monotime();
+	uint64_t budget = 1000000ULL * bgshare / 100 / xfps;
+	struct timeval zero;
+	fd_set fds;
+	int n, total = 0;
+
+	term->nextread = start + 1000000 / bgfps;
+	do {
+		if((n = ttyread(term)) <= 0)
+			return n;
+		total += n;
+
+		zero = (struct timeval){ 0, 0 };
+		FD_ZERO(&fds);
+		FD_SET(term->cmdfd, &fds);
+	} while(total < bgbatch && monotime() - start < budget
+			&& select(term->cmdfd+1, &fds, NULL, NULL, &zero) > 0);
+
+	return total;
 }
 
 void
@@ -1414,50 +2003,135 @@ ttyresize(Term *term) {
 		fprintf(stderr, "Couldn't set window size: %s\n", SERRNO);
 }
 
-int
-tattrset(Term *term, int attr) {
-	int i, j;
+/* Count the lines of the screen that may blink. */
+void
+tblinkcount(Term *term) {
+	int y;
 
-	for(i = 0; i < term->row-1; i++) {
-		for(j = 0; j < term->col-1; j++) {
-			if(term->line[i][j].mode & attr)
-				return 1;
-		}
+	term->nblink = 0;
+	for(y = 0; y < term->row; y++) {
+		if(LINEPAL(term->line[y], term->col)->mode & ATTR_BLINK)
+			term->nblink++;
 	}
-
-	return 0;
 }
 
 void
 tsetdirt(Term *term, int top, int bot) {
 	int i;
 
+	/* what is not on the screen is painted in full once it is */
+	if(!ISSHOWN(term)) {
+		term->stale = true;
+		return;
+	}
+
 	LIMIT(top, 0, term->row-1);
 	LIMIT(bot, 0, term->row-1);
 
 	for(i = top; i <= bot; i++)
-		term->dirty[i] = 1;
+		term->dirty[i] = (Dirty){ 0, term->col-1 };
 }
 
 void
-tsetdirtattr(Term *term, int attr) {
-	int i, j;
+tsetdirtspan(Term *term, int y, int x1, int x2) {
+	Dirty *d = &term->dirty[y];
 
-	for(i = 0; i < term->row-1; i++) {
-		for(j = 0; j < term->col-1; j++) {
-			if(term->line[i][j].mode & attr) {
-				tsetdirt(term, i, i);
-				break;
-			}
-		}
+	if(!ISSHOWN(term)) {
+		term->stale = true;
+		return;
+	}
+
+	if(d->x1 > d->x2) {
+		d->x1 = x1, d->x2 = x2;
+	} else {
+		d->x1 = MIN(d->x1, x1), d->x2 = MAX(d->x2, x2);
 	}
 }
 
+/*
+ * Mark the lines with glyphs that have attr dirty.  Only the lines whose
+ * summary has it are looked at, and their summaries are made exact.
+ */
+void
+tsetdirtattr(Term *term, int attr) {
+	Palette *pal;
+	ushort mode, *mp;
+	int x, y;
+
+	for(y = 0; y < term->row; y++) {
+		pal = LINEPAL(term->line[y], term->col);
+		if(!(pal->mode & attr))
+			continue;
+		mp = TMODE(term, y);
+		for(mode = 0, x = 0; x < term->col; x++)
+			mode |= mp[x];
+		pal->mode = mode;
+		if(mode & attr)
+			tsetdirt(term, y, y);
+	}
+	tblinkcount(term);
+}
+
 void
 tfulldirt(Term *term) {
+	term->stale = false;
+	term->nmoves = 0;
 	tsetdirt(term, 0, term->row-1);
 }
 
+/*
+ * Note that the cells x1..x2, y1..y2 were shifted by dx, dy, with the
+ * ones shifted out of that rectangle dropped, so that the next frame can
+ * copy their pixels instead of painting them again.  The cells left
+ * behind must be cleared by the caller.  Consecutive shifts of the same
+ * rectangle are summed up.
+ */
+void
+tmove(Term *term, int x1, int y1, int x2, int y2, int dx, int dy) {
+#ifdef OPTIMIZE_RENDER
+	Move *m = term->nmoves ? &term->moves[term->nmoves-1] : NULL;
+	int y;
+
+	if(!ISSHOWN(term)) {
+		term->stale = true;
+		return;
+	}
+	if(!dx && !dy)
+		return;
+	if(abs(dx) > x2-x1 || abs(dy) > y2-y1)
+		goto dirty;
+
+	/* partly painted lines and selections do not move sideways */
+	if(dx) {
+		for(y = y1; y <= y2; y++) {
+			if(ISDIRTY(term, y) || (sel.bx != -1
+					&& BETWEEN(y, sel.by, sel.ey))) {
+				goto dirty;
+			}
+		}
+	}
+
+	if(m && m->x1 == x1 && m->y1 == y1 && m->x2 == x2 && m->y2 == y2
+			&& !m->dx == !dx && !m->dy == !dy) {
+		m->dx += dx, m->dy += dy;
+		if((!m->dx && !m->dy) || abs(m->dx) > x2-x1
+				|| abs(m->dy) > y2-y1) {
+			/* nothing left to copy */
+			term->nmoves--;
+		}
+		return;
+	}
+	if(term->nmoves < LEN(term->moves)) {
+		term->moves[term->nmoves++] = (Move){ x1, y1, x2, y2, dx, dy };
+		return;
+	}
+
+dirty:
+#endif
+	for(; y1 <= y2; y1++)
+		tsetdirtspan(term, y1, x1, x2);
+}
+
 void
 tcursor(Term *term, int mode) {
 	static TCursor c;
@@ -1510,6 +2184,7 @@ tswapscreen(Term *term) {
 	term->line = term->alt;
 	term->alt = tmp;
 	term->mode ^= MODE_ALTSCREEN;
+	tblinkcount(term);
 	tfulldirt(term);
 }
 
@@ -1518,7 +2193,10 @@ set_message(char *fmt, ...) {
 	int ret;
 
 	if (fmt == NULL) {
-		if (status_msg) free(status_msg);
+		if (status_msg) {
+			free(status_msg);
+			bargen++;
+		}
 		status_msg = NULL;
 		return 0;
 	}
@@ -1534,6 +2212,7 @@ set_message(char *fmt, ...) {
 	if (status_msg) free(status_msg);
 	status_msg = text;
 	gettimeofday(&status_time, NULL);
+	bargen++;
 
 	return ret;
 }
@@ -1565,7 +2244,7 @@ tscrollback(Term *term, int n) {
 	// scrollback, save the current lines in a buffer to remember them.
 	if (base == 0) {
 		for (i = 0; i < term->row; i++) {
-			memcpy(term->last_line[i], term->line[i], term->col * sizeof(Glyph));
+			memcpy(term->last_line[i], term->line[i], LINESIZ(term->col));
 		}
 	}
 
@@ -1573,13 +2252,14 @@ tscrollback(Term *term, int n) {
 	for (i = 0; i < term->row; i++) {
 		y = i + term->ybase;
 		if (y < 0) {
-			memcpy(term->line[i], scrollback_get(term, -(y + 1)), term->col * sizeof(Glyph));
+			memcpy(term->line[i], scrollback_get(term, -(y + 1)), LINESIZ(term->col));
 		} else {
-			memcpy(term->line[i], term->last_line[y], term->col * sizeof(Glyph));
+			memcpy(term->line[i], term->last_line[y], LINESIZ(term->col));
 		}
 		// This is unnecessary. The next call to redraw will handle this.
-		term->dirty[i] = 1;
+		tsetdirt(term, i, i);
 	}
+	tblinkcount(term);
 
 	// Ensure a redraw of the screen.
 	if (term == focused_term) redraw(0);
@@ -1589,59 +2269,28 @@ void
 tscrolldown(Term *term, int orig, int n) {
 	int i;
 	Line temp;
+	Dirty d;
 
 	LIMIT(n, 0, term->bot-orig+1);
 
-#ifdef OPTIMIZE_RENDER
-	if (term == focused_term && !term->swapped_lines) {
-		// NOTE: We only allow this optimization once per draw.
-		// NOTE: We could also measure time.
-		// NOTE: Could make this an int and increment and check
-		// (could also do this for tsetchar optimization).
-		term->swapped_lines = true;
-
-		/* need to get dirty lines written to the buffer */
-		//drawregion(0, 0, term->col, term->row);
-		drawregion(0, orig + n - 1, term->col, term->row);
-
-		/* remove the old cursor */
-		// if (orig >= term->c.y...
-		xdraws(
-			term->line[term->c.y][term->c.x].c,
-			term->line[term->c.y][term->c.x],
-			term->c.x, term->c.y, 1,
-			utf8size(term->line[term->c.y][term->c.x].c));
-
-		for(i = term->bot; i >= orig+n; i--) {
-			temp = term->line[i];
-			term->line[i] = term->line[i-n];
-			term->line[i-n] = temp;
-		}
-
-		//xmove(0, orig+n, 0, orig, term->col, term->bot-orig);
-		xmove(0, orig+n, 0, orig, term->col, MAX(term->bot-orig-(n-1), 0));
-		tclearregion(term, 0, orig, term->col-1, orig+n-1);
-
-		selscroll(term, orig, n);
-		return;
-	}
-#endif
-
-	tclearregion(term, 0, term->bot-n+1, term->col-1, term->bot);
-
+	/* lines that were not painted yet take their dirtyness along */
 	for(i = term->bot; i >= orig+n; i--) {
 		temp = term->line[i];
 		term->line[i] = term->line[i-n];
 		term->line[i-n] = temp;
 
-		term->dirty[i] = 1;
-		term->dirty[i-n] = 1;
+		d = term->dirty[i];
+		term->dirty[i] = term->dirty[i-n];
+		term->dirty[i-n] = d;
 	}
 
+	tmove(term, 0, orig, term->col-1, term->bot, 0, n);
+	tclearregion(term, 0, orig, term->col-1, orig+n-1);
+
 	selscroll(term, orig, n);
 }
 
-Glyph *
+Line
 scrollback_get(Term *term, int i) {
 	i = term->sb_pos - 1 - i;
 	if (i < 0) {
@@ -1658,7 +2307,7 @@ scrollback_add(Term *term, int i) {
 	if (term->sb_pos == scrollback) {
 		term->sb_pos = 0;
 	}
-	memcpy(term->sb[term->sb_pos], term->line[i], term->col * sizeof(Glyph));
+	memcpy(term->sb[term->sb_pos], term->line[i], LINESIZ(term->col));
 	term->sb_pos++;
 	if (term->sb_total != scrollback) {
 		term->sb_total++;
@@ -1669,6 +2318,8 @@ void
 tscrollup(Term *term, int orig, int n) {
 	int i;
 	Line temp;
+	Dirty d;
+
 	LIMIT(n, 0, term->bot-orig+1);
 
 	if (orig == term->top && term->ybase == 0 && !(term->mode & MODE_APPKEYPAD)) {
@@ -1678,53 +2329,19 @@ tscrollup(Term *term, int orig, int n) {
 		}
 	}
 
-#ifdef OPTIMIZE_RENDER
-	if (term == focused_term && !term->swapped_lines) {
-		// NOTE: We only allow this optimization once per draw.
-		// NOTE: We could also measure time.
-		// NOTE: Could make this an int and increment and check
-		// (could also do this for tsetchar optimization).
-		term->swapped_lines = true;
-
-		/* need to get dirty lines written to the buffer */
-		//drawregion(0, 0, term->col, term->row);
-		drawregion(0, orig + n - 1, term->col, term->row);
-
-		/* remove the old cursor */
-		// if (orig >= term->c.y...
-		xdraws(
-			term->line[term->c.y][term->c.x].c,
-			term->line[term->c.y][term->c.x],
-			term->c.x, term->c.y, 1,
-			utf8size(term->line[term->c.y][term->c.x].c));
-
-		for(i = orig; i <= term->bot-n; i++) {
-			 temp = term->line[i];
-			 term->line[i] = term->line[i+n];
-			 term->line[i+n] = temp;
-		}
-
-		//xmove(0, orig, 0, orig+n, term->col, term->bot-orig);
-		xmove(0, orig, 0, orig+n, term->col, MAX(term->bot-orig-(n-1), 0));
-		tclearregion(term, 0, term->bot-n+1, term->col-1, term->bot);
-
-		selscroll(term, orig, -n);
-
-		return;
-	}
-#endif
-
-	tclearregion(term, 0, orig, term->col-1, orig+n-1);
-
 	for(i = orig; i <= term->bot-n; i++) {
 		 temp = term->line[i];
 		 term->line[i] = term->line[i+n];
 		 term->line[i+n] = temp;
 
-		 term->dirty[i] = 1;
-		 term->dirty[i+n] = 1;
+		 d = term->dirty[i];
+		 term->dirty[i] = term->dirty[i+n];
+		 term->dirty[i+n] = d;
 	}
 
+	tmove(term, 0, orig, term->col-1, term->bot, 0, -n);
+	tclearregion(term, 0, term->bot-n+1, term->col-1, term->bot);
+
 	selscroll(term, orig, -n);
 }
 
@@ -1736,8 +2353,10 @@ selscroll(Term *term, int orig, int n) {
 	if(BETWEEN(sel.by, orig, term->bot) || BETWEEN(sel.ey, orig, term->bot)) {
 		if((sel.by += n) > term->bot || (sel.ey += n) < term->top) {
 			sel.bx = -1;
+			tsetdirt(term, orig, term->bot);
 			return;
 		}
+		/* the highlight was copied along, unless it is cut here */
 		if(sel.type == SEL_RECTANGULAR) {
 			if(sel.by < term->top)
 				sel.by = term->top;
@@ -1753,6 +2372,8 @@ selscroll(Term *term, int orig, int n) {
 				sel.ex = term->col;
 			}
 		}
+		if(sel.by == term->top || sel.ey == term->bot)
+			tsetdirt(term, sel.by, sel.ey);
 		sel.b.y = sel.by, sel.b.x = sel.bx;
 		sel.e.y = sel.ey, sel.e.x = sel.ex;
 	}
@@ -1826,7 +2447,7 @@ tmoveto(Term *term, int x, int y) {
 }
 
 void
-tsetchar(Term *term, char *c, Glyph *attr, int x, int y) {
+tsetchar(Term *term, long u, Glyph *attr, int x, int y) {
 	static char *vt100_0[62] = { /* 0x41 - 0x7e */
 		"↑", "↓", "→", "←", "█", "▚", "☃", /* A - G */
 		0, 0, 0, 0, 0, 0, 0, 0, /* H - O */
@@ -1837,71 +2458,291 @@ tsetchar(Term *term, char *c, Glyph *attr, int x, int y) {
 		"⎻", "─", "⎼", "⎽", "├", "┤", "┴", "┬", /* p - w */
 		"│", "≤", "≥", "π", "≠", "£", "·", /* x - ~ */
 	};
+	Glyph g;
 
 	/*
 	 * The table is proudly stolen from rxvt.
 	 */
 	if(attr->mode & ATTR_GFX) {
-		if(c[0] >= 0x41 && c[0] <= 0x7e
-				&& vt100_0[c[0] - 0x41]) {
-			c = vt100_0[c[0] - 0x41];
-		}
+		if(BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41])
+			utf8decode(vt100_0[u - 0x41], &u);
 	}
 
-#ifdef OPTIMIZE_RENDER
-	//if (term == focused_term) {
-	if (term == focused_term && term->last_ret > (term->row * term->col) / 2) {
-		term->line[y][x] = *attr;
-		memcpy(term->line[y][x].c, c, UTF_SIZ);
-		xdraws(
-			term->line[y][x].c,
-			term->line[y][x], x, y, 1,
-			utf8size(term->line[y][x].c));
-		return;
-	}
-#endif
+	tsetdirtspan(term, y, x, x);
+	g = tlineattr(term, attr, y);
+	g.u = u;
+	lset(term->line[y], term->col, x, &g);
+}
 
-	term->dirty[y] = 1;
-	term->line[y][x] = *attr;
-	memcpy(term->line[y][x].c, c, UTF_SIZ);
+/*
+ * Cells x1 to x2 of line y are about to be overwritten, or moved apart
+ * from the rest of the line: blank the wide characters they cut, both
+ * halves.
+ */
+void
+tsplitwide(Term *term, int x1, int x2, int y) {
+	uint32_t *l = term->line[y];
+	ushort *mp = TMODE(term, y);
+
+	if(x1 > 0 && mp[x1] & ATTR_WDUMMY) {
+		l[x1-1] = l[x1] = ' ';
+		mp[x1-1] &= ~ATTR_WIDE;
+		mp[x1] &= ~ATTR_WDUMMY;
+		tsetdirtspan(term, y, x1-1, x1);
+	}
+	if(x2 < term->col-1 && mp[x2] & ATTR_WIDE) {
+		l[x2] = l[x2+1] = ' ';
+		mp[x2] &= ~ATTR_WIDE;
+		mp[x2+1] &= ~ATTR_WDUMMY;
+		tsetdirtspan(term, y, x2, x2+1);
+	}
 }
 
+/* Combine the mark u with the character in cell x of line y. */
 void
-tclearregion(Term *term, int x1, int y1, int x2, int y2) {
-	int x, y, temp;
+tcombine(Term *term, int x, int y, uint32_t u) {
+	uint32_t seq[CLUSTERLEN], c = term->line[y][x];
+	Cluster *cl;
+	int n = 1;
+
+	if(c & CLUSTER) {
+		cl = &term->clusters[c & ~CLUSTER];
+		if(cl->n == CLUSTERLEN)
+			return;
+		memcpy(seq, cl->u, cl->n * sizeof(*seq));
+		n = cl->n;
+	} else {
+		seq[0] = c;
+	}
+	seq[n++] = u;
 
-	if(x1 > x2)
-		temp = x1, x1 = x2, x2 = temp;
-	if(y1 > y2)
-		temp = y1, y1 = y2, y2 = temp;
+	term->line[y][x] = tintern(term, seq, n);
+	tsetdirtspan(term, y, x, x);
+}
 
-	LIMIT(x1, 0, term->col-1);
-	LIMIT(x2, 0, term->col-1);
-	LIMIT(y1, 0, term->row-1);
-	LIMIT(y2, 0, term->row-1);
+uint32_t
+clusterhash(uint32_t *u, int n) {
+	uint32_t h = 2166136261U;
 
-#ifdef OPTIMIZE_RENDER_
-	if (y2 - y1 <= 5 && term == focused_term) {
-		for(y = y1; y <= y2; y++) {
-			for(x = x1; x <= x2; x++) {
-				if(selected(x, y))
-					selclear(NULL);
-				term->line[y][x] = term->c.attr;
-				memcpy(term->line[y][x].c, " ", 2);
-				if (xw.draw) xdraws(term->line[y][x].c, term->line[y][x], x, y, 1, 1);
+	while(n--)
+		h = (h ^ *u++) * 16777619U;
+	return h;
+}
+
+/*
+ * The CLUSTER handle of the n code points u, which are shared by all
+ * cells of the tab that show them.  Clusters no cell names any more are
+ * only taken back when the table is full, so that writing a cell does
+ * not have to look at what it held.
+ */
+uint32_t
+tintern(Term *term, uint32_t *u, int n) {
+	uint32_t h = clusterhash(u, n);
+	int i, j, size = 2 * term->ncluster, old;
+	Cluster *cl;
+
+	for(j = size ? h % size : 0; size && (i = term->clusterhash[j]) != -1;
+			j = (j + 1) % size) {
+		cl = &term->clusters[i];
+		if(cl->n == n && !memcmp(cl->u, u, n * sizeof(*u)))
+			return CLUSTER | i;
+	}
+
+	if(term->nclusterused == term->ncluster) {
+		if(term->ncluster)
+			tsweep(term);
+		if(term->nclusterused > term->ncluster / 2
+				&& term->ncluster < CLUSTERMAX) {
+			old = term->ncluster;
+			term->ncluster = MAX(64, 2 * old);
+			term->clusters = xrealloc(term->clusters,
+					term->ncluster * sizeof(Cluster));
+			memset(term->clusters + old, 0,
+					(term->ncluster - old) * sizeof(Cluster));
+			tclusterindex(term);
+		}
+		if(term->nclusterused == term->ncluster)
+			return u[0];
+	}
+
+	for(i = 0; term->clusters[i].u; i++)
+		/* nothing */;
+	cl = &term->clusters[i];
+	cl->u = xmalloc(n * sizeof(*u));
+	memcpy(cl->u, u, n * sizeof(*u));
+	cl->n = n;
+	term->nclusterused++;
+
+	size = 2 * term->ncluster;
+	for(j = h % size; term->clusterhash[j] != -1; j = (j + 1) % size)
+		/* nothing */;
+	term->clusterhash[j] = i;
+
+	return CLUSTER | i;
+}
+
+/* Free the clusters no cell of the screens or the scrollback names. */
+void
+tsweep(Term *term) {
+	Line *screens[] = { term->line, term->alt, term->last_line };
+	uint32_t u;
+	int i, x, y;
+
+	for(i = 0; i < term->ncluster; i++)
+		term->clusters[i].mark = false;
+
+	for(i = 0; i < LEN(screens) + term->sb_total; i++) {
+		for(y = 0; y < (i < LEN(screens) ? term->row : 1); y++) {
+			for(x = 0; x < term->col; x++) {
+				u = i < LEN(screens) ? screens[i][y][x]
+					: term->sb[i - LEN(screens)][x];
+				if(u & CLUSTER && (u & ~CLUSTER) < term->ncluster)
+					term->clusters[u & ~CLUSTER].mark = true;
 			}
 		}
-		return;
 	}
-#endif
 
-	for(y = y1; y <= y2; y++) {
-		term->dirty[y] = 1;
-		for(x = x1; x <= x2; x++) {
-			if(selected(x, y))
-				selclear(NULL);
-			term->line[y][x] = term->c.attr;
-			memcpy(term->line[y][x].c, " ", 2);
+	for(i = 0; i < term->ncluster; i++) {
+		if(term->clusters[i].u && !term->clusters[i].mark) {
+			free(term->clusters[i].u);
+			term->clusters[i].u = NULL;
+			term->nclusterused--;
+		}
+	}
+	tclusterindex(term);
+}
+
+/* Rebuild the hash index of the clusters of term. */
+void
+tclusterindex(Term *term) {
+	int i, j, size = 2 * term->ncluster;
+	Cluster *cl;
+
+	term->clusterhash = xrealloc(term->clusterhash, size * sizeof(int));
+	for(j = 0; j < size; j++)
+		term->clusterhash[j] = -1;
+
+	for(i = 0; i < term->ncluster; i++) {
+		cl = &term->clusters[i];
+		if(!cl->u)
+			continue;
+		for(j = clusterhash(cl->u, cl->n) % size;
+				term->clusterhash[j] != -1;
+				j = (j + 1) % size)
+			/* nothing */;
+		term->clusterhash[j] = i;
+	}
+}
+
+/* attr, which is the cursor's, as stored in line y */
+Glyph
+tlineattr(Term *term, Glyph *attr, int y) {
+	Palette *pal = LINEPAL(term->line[y], term->col);
+	Glyph g = *attr;
+
+	if(g.mode & ~pal->mode & ATTR_BLINK)
+		term->nblink++;
+	pal->mode |= g.mode;
+
+	/* the bg must not take back the slot just given to the fg */
+	if(g.fg & TRUECOL)
+		g.fg = tpalette(term, y, term->c.fgrgb, 0);
+	if(g.bg & TRUECOL) {
+		g.bg = tpalette(term, y, term->c.bgrgb, g.fg & TRUECOL
+				? 1 << (g.fg & (PALSIZ-1)) : 0);
+	}
+	return g;
+}
+
+/*
+ * The slot of rgb in the palette of line y.  A full palette takes back the
+ * slots no cell uses any more; if there are none the nearest colour of the
+ * 256 colour cube is used instead.  The slots in keep are not taken back.
+ */
+ushort
+tpalette(Term *term, int y, uint32_t rgb, uint keep) {
+	Palette *pal = LINEPAL(term->line[y], term->col);
+	uint32_t *cp = LINECOL(term->line[y], term->col);
+	uchar r = rgb >> 16, g = rgb >> 8, b = rgb;
+	uint used = keep;
+	int i, x;
+
+	for(i = 0; i < pal->n; i++) {
+		if(pal->rgb[i][0] == r && pal->rgb[i][1] == g
+				&& pal->rgb[i][2] == b) {
+			return TRUECOL | i;
+		}
+	}
+
+	if(pal->n < PALSIZ) {
+		i = pal->n++;
+	} else {
+		for(x = 0; x < term->col; x++) {
+			if(cp[x] & TRUECOL)
+				used |= 1 << (cp[x] & (PALSIZ-1));
+			if(cp[x] >> 16 & TRUECOL)
+				used |= 1 << (cp[x] >> 16 & (PALSIZ-1));
+		}
+		for(i = 0; i < PALSIZ && used & 1 << i; i++)
+			/* nothing */;
+		if(i == PALSIZ) {
+			tcolstat.quantized++;
+			return 16 + 36 * CUBE(r) + 6 * CUBE(g) + CUBE(b);
+		}
+	}
+	pal->rgb[i][0] = r;
+	pal->rgb[i][1] = g;
+	pal->rgb[i][2] = b;
+
+	return TRUECOL | i;
+}
+
+void
+tclearregion(Term *term, int x1, int y1, int x2, int y2) {
+	int x, y, temp;
+	uint32_t *l, *cp, c;
+	ushort *mp;
+	Palette *pal;
+	Glyph g;
+
+	if(x1 > x2)
+		temp = x1, x1 = x2, x2 = temp;
+	if(y1 > y2)
+		temp = y1, y1 = y2, y2 = temp;
+
+	LIMIT(x1, 0, term->col-1);
+	LIMIT(x2, 0, term->col-1);
+	LIMIT(y1, 0, term->row-1);
+	LIMIT(y2, 0, term->row-1);
+
+	for(y = y1; y <= y2; y++) {
+		tsetdirtspan(term, y, x1, x2);
+		/* a whole line frees all its colours and modes */
+		pal = LINEPAL(term->line[y], term->col);
+		if(x1 == 0 && x2 == term->col-1) {
+			if(pal->mode & ATTR_BLINK)
+				term->nblink--;
+			pal->n = 0;
+			pal->mode = 0;
+		}
+		if(SELROW(y)) {
+			for(x = x1; x <= x2; x++) {
+				if(selected(x, y)) {
+					selclear(NULL);
+					break;
+				}
+			}
+		}
+		tsplitwide(term, x1, x2, y);
+		g = tlineattr(term, &term->c.attr, y);
+		c = COLPAIR(g);
+		l = term->line[y];
+		cp = LINECOL(l, term->col);
+		mp = LINEMODE(l, term->col);
+		for(x = x1; x <= x2; x++) {
+			l[x] = ' ';
+			cp[x] = c;
+			mp[x] = g.mode;
 		}
 	}
 }
@@ -1912,18 +2753,14 @@ tdeletechar(Term *term, int n) {
 	int dst = term->c.x;
 	int size = term->col - src;
 
-#ifndef OPTIMIZE_RENDER_
-	// NOTE: Probably useless anyway since tclearregion sets dirty flag anyway.
-	term->dirty[term->c.y] = 1;
-#endif
-
 	if(src >= term->col) {
 		tclearregion(term, term->c.x, term->c.y, term->col-1, term->c.y);
 		return;
 	}
 
-	memmove(&term->line[term->c.y][dst], &term->line[term->c.y][src],
-			size * sizeof(Glyph));
+	tsplitwide(term, dst, src-1, term->c.y);
+	lmove(term->line[term->c.y], term->col, dst, src, size);
+	tmove(term, dst, term->c.y, term->col-1, term->c.y, -n, 0);
 	tclearregion(term, term->col-n, term->c.y, term->col-1, term->c.y);
 }
 
@@ -1933,18 +2770,15 @@ tinsertblank(Term *term, int n) {
 	int dst = src + n;
 	int size = term->col - dst;
 
-#ifndef OPTIMIZE_RENDER_
-	// NOTE: Probably useless anyway since tclearregion sets dirty flag anyway.
-	term->dirty[term->c.y] = 1;
-#endif
-
 	if(dst >= term->col) {
 		tclearregion(term, term->c.x, term->c.y, term->col-1, term->c.y);
 		return;
 	}
 
-	memmove(&term->line[term->c.y][dst], &term->line[term->c.y][src],
-			size * sizeof(Glyph));
+	/* the cells that stay on the line */
+	tsplitwide(term, src, term->col-1-n, term->c.y);
+	lmove(term->line[term->c.y], term->col, dst, src, size);
+	tmove(term, src, term->c.y, term->col-1, term->c.y, n, 0);
 	tclearregion(term, src, term->c.y, dst - 1, term->c.y);
 }
 
@@ -2011,7 +2845,20 @@ tsetattr(Term *term, int *attr, int l) {
 			term->c.attr.mode &= ~ATTR_REVERSE;
 			break;
 		case 38:
-			if(i + 2 < l && attr[i + 1] == 5) {
+			if(i + 4 < l && attr[i + 1] == 2) {
+				i += 4;
+				if(BETWEEN(attr[i - 2], 0, 255)
+						&& BETWEEN(attr[i - 1], 0, 255)
+						&& BETWEEN(attr[i], 0, 255)) {
+					term->c.attr.fg = TRUECOL;
+					term->c.fgrgb = attr[i - 2] << 16
+						| attr[i - 1] << 8 | attr[i];
+				} else {
+					fprintf(stderr,
+						"erresc: bad fgcolor %d;%d;%d\n",
+						attr[i - 2], attr[i - 1], attr[i]);
+				}
+			} else if(i + 2 < l && attr[i + 1] == 5) {
 				i += 2;
 				if(BETWEEN(attr[i], 0, 255)) {
 					term->c.attr.fg = attr[i];
@@ -2030,7 +2877,20 @@ tsetattr(Term *term, int *attr, int l) {
 			term->c.attr.fg = defaultfg;
 			break;
 		case 48:
-			if(i + 2 < l && attr[i + 1] == 5) {
+			if(i + 4 < l && attr[i + 1] == 2) {
+				i += 4;
+				if(BETWEEN(attr[i - 2], 0, 255)
+						&& BETWEEN(attr[i - 1], 0, 255)
+						&& BETWEEN(attr[i], 0, 255)) {
+					term->c.attr.bg = TRUECOL;
+					term->c.bgrgb = attr[i - 2] << 16
+						| attr[i - 1] << 8 | attr[i];
+				} else {
+					fprintf(stderr,
+						"erresc: bad bgcolor %d;%d;%d\n",
+						attr[i - 2], attr[i - 1], attr[i]);
+				}
+			} else if(i + 2 < l && attr[i + 1] == 5) {
 				i += 2;
 				if(BETWEEN(attr[i], 0, 255)) {
 					term->c.attr.bg = attr[i];
@@ -2084,6 +2944,17 @@ tsetscroll(Term *term, int t, int b) {
 
 #define MODBIT(x, set, bit) ((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
 
+/*
+ * Synchronized update: the application is redrawing and frames of this
+ * terminal are held until it is done, see run().
+ */
+void
+tsync(Term *term, bool set) {
+	if(set && !IS_SET(term, MODE_SYNC))
+		term->syncstart = monotime();
+	MODBIT(term->mode, set, MODE_SYNC);
+}
+
 void
 tsetmode(Term *term, bool priv, bool set, int *args, int narg) {
 	int *lim, mode;
@@ -2099,8 +2970,10 @@ tsetmode(Term *term, bool priv, bool set, int *args, int narg) {
 			case 5: /* DECSCNM -- Reverse video */
 				mode = term->mode;
 				MODBIT(term->mode, set, MODE_REVERSE);
-				if(mode != term->mode)
+				if(mode != term->mode) {
+					tfulldirt(term);
 					redraw(REDRAW_TIMEOUT);
+				}
 				break;
 			case 6: /* DECOM -- Origin */
 				MODBIT(term->c.state, set, CURSOR_ORIGIN);
@@ -2158,6 +3031,9 @@ tsetmode(Term *term, bool priv, bool set, int *args, int narg) {
 			case 1048:
 				tcursor(term, (set) ? CURSOR_SAVE : CURSOR_LOAD);
 				break;
+			case 2026: /* BSU/ESU -- Synchronized update */
+				tsync(term, set);
+				break;
 			default:
 				fprintf(stderr,
 					"erresc: unknown private set/reset mode %d\n",
@@ -2376,6 +3252,17 @@ csihandle(Term *term) {
 			goto unknown;
 		}
 		break;
+	case '$': /* DECRQM -- Request mode, only for synchronized updates */
+		if (csiescseq.priv && csiescseq.arg[0] == 2026
+				&& csiescseq.buf[csiescseq.len-1] == 'p') {
+			char buf[30];
+			int len = snprintf(buf, sizeof(buf), "\x1b[?2026;%d$y",
+					IS_SET(term, MODE_SYNC) ? 1 : 2);
+			ttywrite(term, buf, len);
+		} else {
+			goto unknown;
+		}
+		break;
 	}
 }
 
@@ -2438,6 +3325,7 @@ strhandle(Term *term) {
 				 * TODO if defaultbg color is changed, borders
 				 * are dirty
 				 */
+				xfreebufs();
 				if (term == focused_term) redraw(0);
 			}
 			break;
@@ -2451,6 +3339,11 @@ strhandle(Term *term) {
 		xsettitle(strescseq.args[0]);
 		break;
 	case 'P': { /* DSC -- Device Control String */
+		/* the older form of synchronized updates */
+		if (!strcmp(strescseq.buf, "=1s") || !strcmp(strescseq.buf, "=2s")) {
+			tsync(term, strescseq.buf[1] == '1');
+			break;
+		}
 		/* NOTE: Just send vim some strings it wants to see. */
 		/* receive: ^[P+q2332^[\  */
 		/* reply:   ^[P0+r2332^[\ */
@@ -2533,31 +3426,42 @@ tputtab(Term *term, bool forward) {
 
 void
 techo(Term *term, char *buf, int len) {
+	long u;
+	int n;
+
 	for(; len > 0; buf++, len--) {
 		char c = *buf;
 
 		if(c == '\033') {		/* escape */
-			tputc(term, "^", 1);
-			tputc(term, "[", 1);
+			tputc(term, '^');
+			tputc(term, '[');
 		} else if(c < '\x20') {	/* control code */
 			if(c != '\n' && c != '\r' && c != '\t') {
 				c |= '\x40';
-				tputc(term, "^", 1);
+				tputc(term, '^');
 			}
-			tputc(term, &c, 1);
+			tputc(term, c);
 		} else {
 			break;
 		}
 	}
-	if(len)
-		tputc(term, buf, len);
+	for(; len > 0; buf += n, len -= n) {
+		n = utf8decode(buf, &u);
+		tputc(term, u);
+	}
 }
 
 void
-tputc(Term *term, char *c, int len) {
-	uchar ascii = *c;
+tputc(Term *term, long u) {
+	char c[UTF_SIZ];
+	int len = 0, width, x;
+	uchar ascii = u < 0x80 ? u : 0x80;
 	bool control = ascii < '\x20' || ascii == 0177;
 
+	/* only what is logged or kept in a string is encoded again */
+	if(iofd != -1 || term->esc & ESC_STR)
+		len = utf8encode(&u, c);
+
 	if(iofd != -1) {
 		if(xwrite(iofd, c, len) < 0) {
 			fprintf(stderr, "Error writing in %s:%s\n",
@@ -2687,12 +3591,11 @@ tputc(Term *term, char *c, int len) {
 			term->esc = 0;
 		} else if(term->esc & ESC_TEST) {
 			if(ascii == '8') { /* DEC screen alignment test. */
-				char E[UTF_SIZ] = "E";
 				int x, y;
 
 				for(x = 0; x < term->col; ++x) {
 					for(y = 0; y < term->row; ++y)
-						tsetchar(term, E, &term->c.attr, x, y);
+						tsetchar(term, 'E', &term->c.attr, x, y);
 				}
 			}
 			term->esc = 0;
@@ -2792,25 +3695,138 @@ tputc(Term *term, char *c, int len) {
 		return;
 	if(sel.bx != -1 && BETWEEN(term->c.y, sel.by, sel.ey))
 		sel.bx = -1;
+	/* no locale, a table lookup */
+	width = control ? 1 : WIDTH(u);
+	if(!width) {
+		/* a mark goes with the character before the cursor */
+		x = term->c.x;
+		if(!(term->c.state & CURSOR_WRAPNEXT))
+			x--;
+		if(x > 0 && TMODE(term, term->c.y)[x] & ATTR_WDUMMY)
+			x--;
+		if(x >= 0)
+			tcombine(term, x, term->c.y, u);
+		return;
+	}
 	if(IS_SET(term, MODE_WRAP) && (term->c.state & CURSOR_WRAPNEXT)) {
-		term->line[term->c.y][term->c.x].mode |= ATTR_WRAP;
+		/* on the last cell, even if a wide character's first is c.x */
+		TMODE(term, term->c.y)[term->col-1] |= ATTR_WRAP;
 		tnewline(term, 1);
 	}
 
-	if(IS_SET(term, MODE_INSERT) && term->c.x+1 < term->col) {
-		memmove(&term->line[term->c.y][term->c.x+1],
-			&term->line[term->c.y][term->c.x],
-			(term->col - term->c.x - 1) * sizeof(Glyph));
+	/* a wide character does not fit in the last column */
+	if(term->c.x + width > term->col) {
+		if(IS_SET(term, MODE_WRAP)) {
+			TMODE(term, term->c.y)[term->c.x] |= ATTR_WRAP;
+			tnewline(term, 1);
+		} else {
+			tmoveto(term, term->col - width, term->c.y);
+		}
+	}
+
+	if(IS_SET(term, MODE_INSERT) && term->c.x+width < term->col) {
+		tsplitwide(term, term->c.x, term->col-1-width, term->c.y);
+		lmove(term->line[term->c.y], term->col, term->c.x+width,
+			term->c.x, term->col - term->c.x - width);
+		tsetdirtspan(term, term->c.y, term->c.x, term->col-1);
 	}
 
-	tsetchar(term, c, &term->c.attr, term->c.x, term->c.y);
-	if(term->c.x+1 < term->col) {
-		tmoveto(term, term->c.x+1, term->c.y);
+	tsplitwide(term, term->c.x, term->c.x+width-1, term->c.y);
+	tsetchar(term, u, &term->c.attr, term->c.x, term->c.y);
+	if(width == 2) {
+		tsetchar(term, 0, &term->c.attr, term->c.x+1, term->c.y);
+		TMODE(term, term->c.y)[term->c.x] |= ATTR_WIDE;
+		TMODE(term, term->c.y)[term->c.x+1] |= ATTR_WDUMMY;
+	}
+	if(term->c.x+width < term->col) {
+		tmoveto(term, term->c.x+width, term->c.y);
 	} else {
 		term->c.state |= CURSOR_WRAPNEXT;
 	}
 }
 
+/*
+ * Resize a line from ocol to col columns.  Each of its arrays moves to
+ * where it starts for col, with the palette behind them.
+ */
+Line
+lresize(Line line, int ocol, int col) {
+	Line new;
+	int n = MIN(ocol, col);
+
+	if(line && col == ocol)
+		return line;
+	new = xcalloc(1, LINESIZ(col));
+	if(!line)
+		return new;
+
+	memcpy(new, line, n * sizeof(*line));
+	memcpy(LINECOL(new, col), LINECOL(line, ocol), n * sizeof(*line));
+	memcpy(LINEMODE(new, col), LINEMODE(line, ocol), n * sizeof(ushort));
+	*LINEPAL(new, col) = *LINEPAL(line, ocol);
+	free(line);
+
+	/* a wide character whose second half was cut off */
+	if(col < ocol && LINEMODE(new, col)[col-1] & ATTR_WIDE) {
+		new[col-1] = ' ';
+		LINEMODE(new, col)[col-1] &= ~ATTR_WIDE;
+	}
+
+	return new;
+}
+
+/* Cell x of a line of col cells. */
+Glyph
+lget(Line line, int col, int x) {
+	uint32_t c = LINECOL(line, col)[x];
+	Glyph g;
+
+	g.u = line[x];
+	g.mode = LINEMODE(line, col)[x];
+	g.fg = c;
+	g.bg = c >> 16;
+	return g;
+}
+
+void
+lset(Line line, int col, int x, Glyph *g) {
+	line[x] = g->u;
+	LINECOL(line, col)[x] = COLPAIR(*g);
+	LINEMODE(line, col)[x] = g->mode;
+}
+
+/*
+ * Whether the code points u[0] to u[n-1] are in the cells of a line of col
+ * cells from x on.  The second halves of wide characters are passed over.
+ */
+bool
+lmatch(Line line, int col, int x, uint32_t *u, int n) {
+	ushort *mp = LINEMODE(line, col);
+	int i;
+
+	if(mp[x] & ATTR_WDUMMY)
+		return false;
+	for(i = 0; i < n; x++) {
+		if(x >= col)
+			return false;
+		if(mp[x] & ATTR_WDUMMY)
+			continue;
+		if(line[x] != u[i++])
+			return false;
+	}
+	return true;
+}
+
+/* Move n cells of a line of col cells from src to dst, like memmove(). */
+void
+lmove(Line line, int col, int dst, int src, int n) {
+	memmove(&line[dst], &line[src], n * sizeof(*line));
+	memmove(&LINECOL(line, col)[dst], &LINECOL(line, col)[src],
+			n * sizeof(*line));
+	memmove(&LINEMODE(line, col)[dst], &LINEMODE(line, col)[src],
+			n * sizeof(ushort));
+}
+
 int
 tresize(Term *term, int col, int row) {
 	int i;
@@ -2860,23 +3876,24 @@ tresize(Term *term, int col, int row) {
 	}
 	// if (term->col != col) {
 	for(i = 0; i < scrollback; i++) {
-		term->sb[i] = xrealloc(term->sb[i], col * sizeof(Glyph));
+		term->sb[i] = lresize(term->sb[i], term->col, col);
 	}
 
 	/* resize each row to new width, zero-pad if needed */
+	term->nmoves = 0;
 	for(i = 0; i < minrow; i++) {
-		term->dirty[i] = 1;
-		term->line[i] = xrealloc(term->line[i], col * sizeof(Glyph));
-		term->alt[i]  = xrealloc(term->alt[i],  col * sizeof(Glyph));
-		term->last_line[i] = xrealloc(term->last_line[i], col * sizeof(Glyph));
+		term->dirty[i] = (Dirty){ 0, col-1 };
+		term->line[i] = lresize(term->line[i], term->col, col);
+		term->alt[i]  = lresize(term->alt[i], term->col, col);
+		term->last_line[i] = lresize(term->last_line[i], term->col, col);
 	}
 
 	/* allocate any new rows */
 	for(/* i == minrow */; i < row; i++) {
-		term->dirty[i] = 1;
-		term->line[i] = xcalloc(col, sizeof(Glyph));
-		term->alt [i] = xcalloc(col, sizeof(Glyph));
-		term->last_line[i] = xcalloc(col, sizeof(Glyph));
+		term->dirty[i] = (Dirty){ 0, col-1 };
+		term->line[i] = xcalloc(1, LINESIZ(col));
+		term->alt [i] = xcalloc(1, LINESIZ(col));
+		term->last_line[i] = xcalloc(1, LINESIZ(col));
 	}
 	if(col > term->col) {
 		bp = term->tabs + term->col;
@@ -2909,15 +3926,221 @@ tresize(Term *term, int col, int row) {
 	return (slide > 0);
 }
 
+/*
+ * With tabcache, the back buffer of a tab that is switched away from is
+ * kept, so that switching back to it can skip painting.  Hand the buffer
+ * of the window to the tab old, and take the one kept for the focused
+ * tab, or one of a tab that was shown long ago.  Returns whether the new
+ * buffer still shows the focused tab as it is.
+ */
+bool
+xswapbuf(Term *old) {
+	Term *term, *lru = NULL;
+	Pixmap buf;
+	bool valid;
+	int n = 0;
+
+	if(!tabcache || !xw.draw || old == focused_term)
+		return false;
+
+	if((buf = focused_term->buf)) {
+		focused_term->buf = None;
+		valid = !focused_term->stale && sel.bx == -1;
+	} else {
+		for(term = terms; term; term = term->next) {
+			if(!term->buf)
+				continue;
+			n++;
+			if(!lru || term->bufused < lru->bufused)
+				lru = term;
+		}
+		if(lru && n >= tabcache) {
+			buf = lru->buf;
+			lru->buf = None;
+		} else {
+			buf = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h,
+					DefaultDepth(xw.dpy, xw.scr));
+		}
+		valid = false;
+	}
+
+	old->buf = xw.buf;
+	old->bufcurx = xw.curx, old->bufcury = xw.cury;
+	barlost = true;
+	old->bufused = ++bufuse;
+
+	xw.buf = buf;
+	XftDrawChange(xw.draw, xw.buf);
+	if(valid) {
+		xw.curx = focused_term->bufcurx;
+		xw.cury = focused_term->bufcury;
+	} else {
+		xclear(0, 0, xw.w, xw.h);
+	}
+
+	return valid;
+}
+
+/*
+ * Drop the kept buffers of all tabs and the kept rows, when they cannot
+ * be shown anymore.
+ */
+void
+xfreebufs(void) {
+	Term *term;
+
+	for(term = terms; term; term = term->next) {
+		if(term->buf) {
+			XFreePixmap(xw.dpy, term->buf);
+			term->buf = None;
+		}
+	}
+
+	if(rows.pix) {
+		XFreePixmap(xw.dpy, rows.pix);
+		rows.pix = None;
+	}
+	if(barpix) {
+		XFreePixmap(xw.dpy, barpix);
+		barpix = None;
+	}
+	free(rows.strip);
+	free(rows.seen);
+	rows.strip = NULL;
+	rows.seen = NULL;
+}
+
+/*
+ * What row y of the focused tab looks like, with the selection in it if
+ * rowsel, or 0 if it is not to be kept.  Kept rows are not compared cell
+ * by cell, so *check gets a second hash, computed differently, which has
+ * to match as well; two rows agreeing on both by chance is what would
+ * show a wrong one.
+ */
+uint64_t
+xrowhash(int y, bool rowsel, uint64_t *check) {
+	uint64_t h = 14695981039346656037ULL, c = 0;
+	Palette *pal = LINEPAL(focused_term->line[y], focused_term->col);
+	Cluster *cl;
+	Glyph g;
+	int x, i;
+
+#define HASH(v) (h = (h ^ (v)) * 1099511628211ULL, \
+		c = (c << 7 | c >> 57) + (v) * 0x9e3779b97f4a7c15ULL)
+	if(!rowcache || !xw.draw)
+		return 0;
+
+	HASH(focused_term->mode & (MODE_REVERSE|MODE_BLINK));
+	for(x = 0; x < focused_term->col; x++) {
+		g = lget(focused_term->line[y], focused_term->col, x);
+		if(rowsel && selected(x, y))
+			g.mode ^= ATTR_REVERSE;
+		HASH(g.mode | (uint64_t)g.fg << 16 | (uint64_t)g.bg << 32);
+		if(g.u & CLUSTER) {
+			cl = &focused_term->clusters[g.u & ~CLUSTER];
+			for(i = 0; i < cl->n; i++)
+				HASH(cl->u[i]);
+		} else {
+			HASH(g.u);
+		}
+		if(g.fg & TRUECOL) {
+			i = g.fg & ~TRUECOL;
+			HASH(pal->rgb[i][0] << 16 | pal->rgb[i][1] << 8
+					| pal->rgb[i][2]);
+		}
+		if(g.bg & TRUECOL) {
+			i = g.bg & ~TRUECOL;
+			HASH(pal->rgb[i][0] << 16 | pal->rgb[i][1] << 8
+					| pal->rgb[i][2]);
+		}
+	}
+#undef HASH
+
+	*check = c;
+	return h ? h : 1;
+}
+
+/* Copy the kept row that hashes to h and check to row y, if there is one. */
+bool
+xrowload(uint64_t h, uint64_t check, int y) {
+	int i, winy = borderpx + y * xw.ch;
+
+	for(i = 0; rows.strip && i < rows.n; i++) {
+		if(rows.strip[i].hash == h && rows.strip[i].check == check)
+			break;
+	}
+	if(!rows.strip || i == rows.n) {
+		rows.misses++;
+		rows.nokeep = false;
+		return false;
+	}
+
+	rows.hits++;
+	rows.strip[i].used = ++rows.tick;
+	xdamage(0, winy, xw.w, xw.ch);
+	XCopyArea(xw.dpy, rows.pix, xw.buf, dc.gc, 0, i * xw.ch,
+			xw.w, xw.ch, 0, winy);
+
+	/* as xdraws() does */
+	if(y == 0)
+		xclear(0, 0, xw.w, borderpx);
+	if(xedge(y) > winy + xw.ch)
+		xclear(0, winy + xw.ch, xw.w, xedge(y));
+
+	return true;
+}
+
+/* Keep row y, which was just drawn and hashes to h and check. */
+void
+xrowsave(uint64_t h, uint64_t check, int y) {
+	int i, lru = 0;
+
+	if(rows.nokeep)
+		return;
+
+	if(!rows.seen) {
+		rows.n = MAX(1, MIN(rowcache, SHRT_MAX / xw.ch));
+		rows.seen = xcalloc(rows.n, sizeof(*rows.seen));
+		rows.nseen = 0;
+	}
+	for(i = 0; i < rows.n && rows.seen[i] != h; i++)
+		/* nothing */;
+	if(i == rows.n) {
+		rows.seen[rows.nseen++ % rows.n] = h;
+		return;
+	}
+
+	if(!rows.pix) {
+		rows.pix = XCreatePixmap(xw.dpy, xw.win, xw.w,
+				rows.n * xw.ch, DefaultDepth(xw.dpy, xw.scr));
+		rows.strip = xcalloc(rows.n, sizeof(*rows.strip));
+	}
+	for(i = 0; i < rows.n; i++) {
+		if(rows.strip[i].used < rows.strip[lru].used)
+			lru = i;
+	}
+	rows.strip[lru].hash = h;
+	rows.strip[lru].check = check;
+	rows.strip[lru].used = ++rows.tick;
+	XCopyArea(xw.dpy, xw.buf, rows.pix, dc.gc, 0, borderpx + y * xw.ch,
+			xw.w, xw.ch, 0, lru * xw.ch);
+}
+
 void
 xresize(int col, int row) {
 	xw.tw = MAX(1, col * xw.cw);
 	xw.th = MAX(1, row * xw.ch);
-
-	XFreePixmap(xw.dpy, xw.buf);
-	xw.buf = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h,
-			DefaultDepth(xw.dpy, xw.scr));
-	XftDrawChange(xw.draw, xw.buf);
+	bargen++;
+
+	if(xw.draw) {
+		xfreebufs();
+		XFreePixmap(xw.dpy, xw.buf);
+		xw.buf = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h,
+				DefaultDepth(xw.dpy, xw.scr));
+		XftDrawChange(xw.draw, xw.buf);
+	} else {
+		swresize(xw.w, xw.h);
+	}
 	xclear(0, 0, xw.w, xw.h);
 }
 
@@ -2962,6 +4185,95 @@ xloadcols(void) {
 			die("Could not allocate color %d\n", i);
 		}
 	}
+
+	/*
+	 * Those ranges will not be brightened:
+	 *	8 - 15 – bright system colors
+	 *	196 - 231 – highest 256 color cube
+	 *	252 - 255 – brightest colors in greyscale
+	 */
+	for(i = 0; i < NCOLS; i++) {
+		if(BETWEEN(i, 0, 7)) {
+			/* basic system colors */
+			dc.bright[i] = i + 8;
+		} else if(BETWEEN(i, 16, 195)) {
+			/* 256 colors */
+			dc.bright[i] = i + 36;
+		} else if(BETWEEN(i, 232, 251)) {
+			/* greyscale */
+			dc.bright[i] = i + 4;
+		} else {
+			dc.bright[i] = i;
+		}
+		if(!xloadrev(i))
+			die("Could not allocate color %d\n", i);
+	}
+
+	ntcolsets = MAX(1, truecolours / TCOLWAYS);
+	tcols = xcalloc(ntcolsets * TCOLWAYS, sizeof(*tcols));
+}
+
+/* Allocate the inverse of colour i, which reverse video draws with. */
+int
+xloadrev(int i) {
+	XRenderColor color;
+
+	color.red = ~dc.col[i].color.red;
+	color.green = ~dc.col[i].color.green;
+	color.blue = ~dc.col[i].color.blue;
+	color.alpha = dc.col[i].color.alpha;
+
+	return XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &color, &dc.rev[i]);
+}
+
+/*
+ * The allocated colour for rgb.  The cache is split into sets of TCOLWAYS
+ * colours, and a colour that is missing replaces the least recently used
+ * one of its set.
+ */
+Colour *
+xtruecolour(uint32_t rgb) {
+	int i, set = (rgb * 2654435761U >> 8) % ntcolsets * TCOLWAYS, lru = set;
+	XRenderColor color = { .alpha = 0xffff };
+
+	for(i = set; i < set + TCOLWAYS; i++) {
+		if(tcols[i].used && tcols[i].rgb == rgb) {
+			tcolstat.hits++;
+			tcols[i].used = ++tcolstat.tick;
+			return &tcols[i].col;
+		}
+		if(tcols[i].used < tcols[lru].used)
+			lru = i;
+	}
+
+	tcolstat.misses++;
+	if(tcols[lru].used)
+		XftColorFree(xw.dpy, xw.vis, xw.cmap, &tcols[lru].col);
+	color.red = (rgb >> 16 & 0xff) * 0x101;
+	color.green = (rgb >> 8 & 0xff) * 0x101;
+	color.blue = (rgb & 0xff) * 0x101;
+	if(!XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &color,
+				&tcols[lru].col)) {
+		tcols[lru].used = 0;
+		return &dc.col[defaultfg];
+	}
+	tcols[lru].rgb = rgb;
+	tcols[lru].used = ++tcolstat.tick;
+
+	return &tcols[lru].col;
+}
+
+/* The colour c of a line with palette pal, inverted for reverse video. */
+Colour *
+xcolour(ushort c, Palette *pal, bool rev) {
+	uchar *rgb;
+
+	if(!(c & TRUECOL))
+		return rev ? &dc.rev[c] : &dc.col[c];
+
+	rgb = pal->rgb[c & (PALSIZ-1)];
+	return xtruecolour((rgb[0] << 16 | rgb[1] << 8 | rgb[2])
+			^ (rev ? 0xffffff : 0));
 }
 
 int
@@ -2978,70 +4290,918 @@ xsetcolorname(int x, const char *name) {
 			color.blue = sixd_to_16bit(b);
 			if(!XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &color, &colour))
 				return 0; /* something went wrong */
-			dc.col[x] = colour;
-			return 1;
+			return xsetcolor(x, &colour);
 		} else if (16 + 216 <= x && x < 256) {
 			color.red = color.green = color.blue = 0x0808 + 0x0a0a * (x - (16 + 216));
 			if(!XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &color, &colour))
 				return 0; /* something went wrong */
-			dc.col[x] = colour;
-			return 1;
+			return xsetcolor(x, &colour);
 		} else {
 			name = colorname[x];
 		}
 	}
 	if(!XftColorAllocName(xw.dpy, xw.vis, xw.cmap, name, &colour))
 		return 0;
-	dc.col[x] = colour;
-	return 1;
+	return xsetcolor(x, &colour);
 }
 
-void
-xtermclear(int col1, int row1, int col2, int row2) {
-	XftDrawRect(xw.draw,
-			&dc.col[IS_SET(focused_term, MODE_REVERSE) ? defaultfg : defaultbg],
-			borderpx + col1 * xw.cw,
-			borderpx + row1 * xw.ch,
-			(col2-col1+1) * xw.cw,
-			(row2-row1+1) * xw.ch);
+/* Replace colour x and its inverse, freeing the old ones. */
+int
+xsetcolor(int x, Colour *colour) {
+	Colour col = dc.col[x], rev = dc.rev[x];
+
+	dc.col[x] = *colour;
+	if(!xloadrev(x)) {
+		dc.col[x] = col;
+		XftColorFree(xw.dpy, xw.vis, xw.cmap, colour);
+		return 0;
+	}
+	XftColorFree(xw.dpy, xw.vis, xw.cmap, &col);
+	XftColorFree(xw.dpy, xw.vis, xw.cmap, &rev);
+	return 1;
 }
 
 /*
- * Absolute coordinates.
+ * Drawing primitives. Everything is drawn into the back buffer, either the
+ * xw.buf pixmap through Xft, or the client side image of the software
+ * renderer, and shown with xpresent().
  */
 void
-xclear(int x1, int y1, int x2, int y2) {
-	XftDrawRect(xw.draw,
-			&dc.col[IS_SET(focused_term, MODE_REVERSE)? defaultfg : defaultbg],
-			x1, y1, x2-x1, y2-y1);
+xdrawrect(Colour *c, int x, int y, int w, int h) {
+	xdamage(x, y, w, h);
+	if(xw.draw) {
+		XftDrawRect(xw.draw, c, x, y, w, h);
+	} else {
+		swrect(c->pixel, x, y, w, h);
+	}
+}
+
+/* Add the box around the n rectangles r to the damage, if there is one */
+bool
+xdamagerects(XRectangle *r, int n) {
+	int i, x1 = INT_MAX, y1 = INT_MAX, x2 = INT_MIN, y2 = INT_MIN;
+
+	for(i = 0; i < n; i++) {
+		x1 = MIN(x1, r[i].x);
+		y1 = MIN(y1, r[i].y);
+		x2 = MAX(x2, r[i].x + r[i].width);
+		y2 = MAX(y2, r[i].y + r[i].height);
+	}
+	if(x1 >= x2)
+		return false;
+	xdamage(x1, y1, x2 - x1, y2 - y1);
+	return true;
 }
 
+/* Fill the n rectangles r, in one request */
 void
-xhints(void) {
-	XClassHint class = {opt_class ? opt_class : termname, termname};
-	XWMHints wm = {.flags = InputHint, .input = 1};
-	XSizeHints *sizeh = NULL;
+xdrawrects(Colour *c, XRectangle *r, int n) {
+	int i;
 
-	sizeh = XAllocSizeHints();
-	if(xw.isfixed == False) {
-		sizeh->flags = PSize | PResizeInc | PBaseSize;
-		sizeh->height = xw.h;
-		sizeh->width = xw.w;
-		sizeh->height_inc = xw.ch;
-		sizeh->width_inc = xw.cw;
-		sizeh->base_height = 2 * borderpx;
-		sizeh->base_width = 2 * borderpx;
+	if(!xdamagerects(r, n))
+		return;
+
+	if(xw.draw) {
+		XRenderFillRectangles(xw.dpy, PictOpSrc,
+				XftDrawPicture(xw.draw), &c->color, r, n);
 	} else {
-		sizeh->flags = PMaxSize | PMinSize;
-		sizeh->min_width = sizeh->max_width = xw.fw;
-		sizeh->min_height = sizeh->max_height = xw.fh;
+		for(i = 0; i < n; i++) {
+			swrect(c->pixel, r[i].x, r[i].y,
+					r[i].width, r[i].height);
+		}
 	}
-
-	XSetWMProperties(xw.dpy, xw.win, NULL, NULL, NULL, 0, sizeh, &wm, &class);
-	XFree(sizeh);
 }
 
-int
+/*
+ * Fill the n rectangles r with shade s of shadebits, in one request.  The
+ * pattern is aligned to the window, so neighbouring cells join up.
+ */
+void
+xdrawshades(Colour *c, int s, XRectangle *r, int n) {
+	int i;
+
+	if(!xdamagerects(r, n))
+		return;
+
+	if(xw.draw) {
+		if(!shadegc) {
+			shadegc = XCreateGC(xw.dpy, xw.buf, 0, NULL);
+			XSetFillStyle(xw.dpy, shadegc, FillStippled);
+			for(i = 0; i < LEN(shadestipple); i++) {
+				shadestipple[i] = XCreateBitmapFromData(xw.dpy,
+						xw.win, (char *)shadebits[i], 2, 2);
+			}
+		}
+		XSetStipple(xw.dpy, shadegc, shadestipple[s]);
+		XSetForeground(xw.dpy, shadegc, c->pixel);
+		XFillRectangles(xw.dpy, xw.buf, shadegc, r, n);
+		return;
+	}
+
+	for(i = 0; i < n; i++) {
+		swshade(c->pixel, s, r[i].x, r[i].y, r[i].width,
+				r[i].height);
+	}
+}
+
+void
+xdrawtext(Colour *c, XftFont *font, int x, int y, uint32_t *s, int len) {
+	/* the text is normally clipped to its cells by xdraws() */
+	xdamage(x, y - font->ascent, xw.w - x, font->height);
+	if(xw.draw) {
+		XftDrawString32(xw.draw, c, font, x, y, (FcChar32 *)s, len);
+	} else {
+		swtext(c->pixel, font, x, y, s, len);
+	}
+}
+
+/* Draw a run of text the main font f has, shaped if st has HarfBuzz. */
+void
+xdrawrun(Colour *c, Font *f, int x, int y, uint32_t *s, int len) {
+#ifdef USE_HARFBUZZ
+	Shaped *sh;
+
+	if((sh = xshape(f, s, len))) {
+		xdrawglyphs(c, f->match, x, y, sh->glyphs, sh->nglyphs);
+		return;
+	}
+#endif
+	xdrawtext(c, f->match, x, y, s, len);
+}
+
+/* A zero sized clip rectangle removes the clip. */
+void
+xsetclip(int x, int y, int w, int h) {
+	XRectangle r = { 0, 0, w, h };
+
+	xw.clip = (XRectangle){ x, y, w, h };
+	if(xw.draw) {
+		if(w && h) {
+			XftDrawSetClipRectangles(xw.draw, x, y, &r, 1);
+		} else {
+			XftDrawSetClip(xw.draw, 0);
+		}
+	}
+}
+
+void
+xcopy(int sx, int sy, int w, int h, int dx, int dy) {
+	xdamage(dx, dy, w, h);
+	if(xw.draw) {
+		XCopyArea(xw.dpy, xw.buf, xw.buf, dc.gc, sx, sy, w, h, dx, dy);
+	} else {
+		swcopy(sx, sy, w, h, dx, dy);
+	}
+}
+
+/*
+ * Remember a drawn rectangle, so that only what changed is presented.
+ * Touching rectangles are merged, and when there are too many they are
+ * folded into their bounding box.
+ */
+void
+xdamage(int x, int y, int w, int h) {
+	XRectangle *r;
+	int x1 = MAX(x, 0), y1 = MAX(y, 0);
+	int x2 = MIN(x + w, xw.w), y2 = MIN(y + h, xw.h);
+	int i;
+
+	if(xw.clip.width && xw.clip.height) {
+		x1 = MAX(x1, xw.clip.x);
+		y1 = MAX(y1, xw.clip.y);
+		x2 = MIN(x2, xw.clip.x + xw.clip.width);
+		y2 = MIN(y2, xw.clip.y + xw.clip.height);
+	}
+	if(x1 >= x2 || y1 >= y2)
+		return;
+
+	for(i = 0; i < xw.ndamage; i++) {
+		r = &xw.damage[i];
+		if(x1 <= r->x + r->width && r->x <= x2
+				&& y1 <= r->y + r->height && r->y <= y2) {
+			break;
+		}
+	}
+	if(i == xw.ndamage) {
+		if(xw.ndamage < LEN(xw.damage)) {
+			xw.damage[xw.ndamage++] = (XRectangle){
+				x1, y1, x2 - x1, y2 - y1
+			};
+			return;
+		}
+		for(i = 1; i < xw.ndamage; i++) {
+			r = &xw.damage[i];
+			x1 = MIN(x1, r->x);
+			y1 = MIN(y1, r->y);
+			x2 = MAX(x2, r->x + r->width);
+			y2 = MAX(y2, r->y + r->height);
+		}
+		xw.ndamage = 1;
+		i = 0;
+	}
+
+	r = &xw.damage[i];
+	x2 = MAX(x2, r->x + r->width);
+	y2 = MAX(y2, r->y + r->height);
+	r->x = MIN(x1, r->x);
+	r->y = MIN(y1, r->y);
+	r->width = x2 - r->x;
+	r->height = y2 - r->y;
+}
+
+/* Show the damaged parts of the back buffer. */
+void
+xpresentdamage(void) {
+	uint64_t now;
+	int i;
+
+#ifdef USE_PRESENT
+	XserverRegion update;
+
+	/* timed by the completion events instead, see presentevent() */
+	if(present.opcode && xw.draw) {
+		if(xw.ndamage) {
+			update = XFixesCreateRegion(xw.dpy, xw.damage,
+					xw.ndamage);
+			XPresentPixmap(xw.dpy, xw.win, xw.buf, ++present.serial,
+					None, update, 0, 0, None, None, None,
+					PresentOptionNone, 0, 0, 0, NULL, 0);
+			XFixesDestroyRegion(xw.dpy, update);
+			present.busy = true;
+			present.sent = monotime();
+		}
+		xw.ndamage = 0;
+		return;
+	}
+#endif
+
+	if(xw.ndamage) {
+		now = monotime();
+		if(lastframe)
+			statadd(&framestat, now - lastframe);
+		lastframe = now;
+	}
+	for(i = 0; i < xw.ndamage; i++) {
+		xpresent(xw.damage[i].x, xw.damage[i].y,
+				xw.damage[i].width, xw.damage[i].height);
+	}
+	xw.ndamage = 0;
+}
+
+void
+xpresent(int x, int y, int w, int h) {
+	if(xw.draw) {
+		XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, x, y, w, h, x, y);
+	} else if(sw.useshm) {
+		XShmPutImage(xw.dpy, xw.win, dc.gc, sw.img, x, y, x, y, w, h,
+				False);
+		sw.busy = true;
+	} else {
+		XPutImage(xw.dpy, xw.win, dc.gc, sw.img, x, y, x, y, w, h);
+	}
+}
+
+#ifdef USE_PRESENT
+void
+presentinit(void) {
+	int event, error;
+
+	if(!XPresentQueryExtension(xw.dpy, &present.opcode, &event, &error)) {
+		present.opcode = 0;
+		return;
+	}
+	XPresentSelectInput(xw.dpy, xw.win,
+			PresentCompleteNotifyMask | PresentIdleNotifyMask);
+	present.refresh = 1000000 / xfps;
+}
+
+void
+presentevent(XEvent *ev) {
+	XGenericEventCookie *c = &ev->xcookie;
+	XPresentCompleteNotifyEvent *ce;
+	XPresentIdleNotifyEvent *ie;
+
+	if(c->extension != present.opcode || !XGetEventData(xw.dpy, c))
+		return;
+
+	switch(c->evtype) {
+	case PresentCompleteNotify:
+		ce = c->data;
+		if(ce->kind != PresentCompleteKindPixmap)
+			break;
+		if(present.ust && ce->msc > present.msc) {
+			statadd(&framestat, ce->ust - present.ust);
+			present.refresh = (ce->ust - present.ust)
+				/ (ce->msc - present.msc);
+		}
+		present.ust = ce->ust;
+		present.msc = ce->msc;
+
+		if(keyprobe.key && keyprobe.stage == KEY_FLUSH
+				&& ce->serial_number == keyprobe.serial) {
+			statadd(&keystat[KEY_SHOWN], ce->ust - keyprobe.key);
+			keyprobe.key = 0;
+		}
+		break;
+	case PresentIdleNotify:
+		ie = c->data;
+		if(ie->serial_number == present.serial)
+			present.busy = false;
+		break;
+	}
+	XFreeEventData(xw.dpy, c);
+}
+
+/*
+ * Whether to draw now, so that the frame makes it to the next vblank
+ * with as much of the input as possible.  Otherwise *tv is set to how
+ * long to wait.
+ */
+bool
+presentdue(struct timeval *tv) {
+	uint64_t now = monotime(), next, wait;
+
+	if(present.busy) {
+		/* frames for hidden windows may never complete */
+		if(now - present.sent < 100000) {
+			tv->tv_sec = 0;
+			tv->tv_usec = present.refresh;
+			return false;
+		}
+		present.busy = false;
+	}
+	if(!present.ust || !present.refresh || now < present.ust)
+		return true;
+
+	next = present.ust + ((now - present.ust) / present.refresh + 1)
+		* present.refresh;
+	if(next - now <= presentmargin * 1000)
+		return true;
+
+	wait = next - now - presentmargin * 1000;
+	tv->tv_sec = 0;
+	tv->tv_usec = wait;
+	return false;
+}
+#endif
+
+/*
+ * Software renderer. Glyphs are rasterized with FreeType from the faces Xft
+ * has already opened, and painted into a 32 bit image shared with the
+ * server through MIT-SHM. Without MIT-SHM (remote displays) the image is
+ * sent with XPutImage instead.
+ */
+static int
+swxerror(Display *dpy, XErrorEvent *e) {
+	sw.failed = true;
+	return 0;
+}
+
+bool
+swinit(int w, int h) {
+	int endian = 1;
+
+	if(xw.vis->class != TrueColor || xw.vis->red_mask != 0xff0000
+			|| xw.vis->green_mask != 0xff00
+			|| xw.vis->blue_mask != 0xff) {
+		return false;
+	}
+	sw.byteorder = *(char *)&endian ? LSBFirst : MSBFirst;
+	sw.useshm = XShmQueryExtension(xw.dpy);
+
+	return swresize(w, h);
+}
+
+void
+swfree(void) {
+	if(!sw.img)
+		return;
+	if(sw.useshm) {
+		XShmDetach(xw.dpy, &sw.info);
+		XSync(xw.dpy, False);
+		shmdt(sw.info.shmaddr);
+		sw.img->data = NULL;
+	}
+	XDestroyImage(sw.img);
+	sw.img = NULL;
+	sw.busy = false;
+}
+
+bool
+swresize(int w, int h) {
+	int (*handler)(Display *, XErrorEvent *);
+	int depth = DefaultDepth(xw.dpy, xw.scr);
+
+	swfree();
+
+	if(sw.useshm) {
+		sw.img = XShmCreateImage(xw.dpy, xw.vis, depth, ZPixmap, NULL,
+				&sw.info, w, h);
+		if(!sw.img)
+			goto noshm;
+		sw.info.shmid = shmget(IPC_PRIVATE, sw.img->bytes_per_line * h,
+				IPC_CREAT | 0600);
+		if(sw.info.shmid < 0) {
+			XDestroyImage(sw.img);
+			goto noshm;
+		}
+		sw.info.shmaddr = sw.img->data = shmat(sw.info.shmid, NULL, 0);
+		sw.info.readOnly = False;
+
+		/* attaching fails on displays that are not local */
+		sw.failed = false;
+		handler = XSetErrorHandler(swxerror);
+		XShmAttach(xw.dpy, &sw.info);
+		XSync(xw.dpy, False);
+		XSetErrorHandler(handler);
+		shmctl(sw.info.shmid, IPC_RMID, NULL);
+
+		if(sw.failed) {
+			shmdt(sw.info.shmaddr);
+			sw.img->data = NULL;
+			XDestroyImage(sw.img);
+			goto noshm;
+		}
+	} else {
+noshm:
+		sw.useshm = false;
+		sw.img = XCreateImage(xw.dpy, xw.vis, depth, ZPixmap, 0,
+				xmalloc(w * h * 4), w, h, 32, 0);
+	}
+
+	if(!sw.img || sw.img->bits_per_pixel != 32
+			|| sw.img->byte_order != sw.byteorder) {
+		swfree();
+		return false;
+	}
+	xw.clip = (XRectangle){ 0, 0, 0, 0 };
+
+	return true;
+}
+
+/* The server may still be reading the image from the last present. */
+static inline void
+swsync(void) {
+	if(sw.busy) {
+		XSync(xw.dpy, False);
+		sw.busy = false;
+	}
+}
+
+/* Intersect a rectangle with the image and the clip rectangle. */
+static bool
+swclip(int *x, int *y, int *w, int *h) {
+	int x1 = MAX(*x, 0), y1 = MAX(*y, 0);
+	int x2 = MIN(*x + *w, sw.img->width), y2 = MIN(*y + *h, sw.img->height);
+
+	if(xw.clip.width && xw.clip.height) {
+		x1 = MAX(x1, xw.clip.x);
+		y1 = MAX(y1, xw.clip.y);
+		x2 = MIN(x2, xw.clip.x + xw.clip.width);
+		y2 = MIN(y2, xw.clip.y + xw.clip.height);
+	}
+	if(x1 >= x2 || y1 >= y2)
+		return false;
+
+	*x = x1, *y = y1, *w = x2 - x1, *h = y2 - y1;
+	return true;
+}
+
+#define SWROW(y) ((uint32_t *)(sw.img->data + (y) * sw.img->bytes_per_line))
+
+void
+swrect(ulong pixel, int x, int y, int w, int h) {
+	uint32_t *row;
+	int i, j;
+
+	if(!swclip(&x, &y, &w, &h))
+		return;
+	swsync();
+
+	for(j = y; j < y + h; j++) {
+		row = SWROW(j) + x;
+		for(i = 0; i < w; i++)
+			row[i] = pixel;
+	}
+}
+
+/* Fill a rectangle with shade s of shadebits, see xdrawshades() */
+void
+swshade(ulong pixel, int s, int x, int y, int w, int h) {
+	uint32_t *row;
+	int i, j;
+
+	if(!swclip(&x, &y, &w, &h))
+		return;
+	swsync();
+
+	for(j = y; j < y + h; j++) {
+		row = SWROW(j);
+		for(i = x; i < x + w; i++) {
+			if(shadebits[s][j & 1] >> (i & 1) & 1)
+				row[i] = pixel;
+		}
+	}
+}
+
+void
+swcopy(int sx, int sy, int w, int h, int dx, int dy) {
+	int j;
+
+	/* clip both rectangles against the image */
+	w = MIN(w, MIN(sw.img->width - sx, sw.img->width - dx));
+	h = MIN(h, MIN(sw.img->height - sy, sw.img->height - dy));
+	if(w <= 0 || h <= 0 || sx < 0 || sy < 0 || dx < 0 || dy < 0)
+		return;
+	swsync();
+
+	if(dy <= sy) {
+		for(j = 0; j < h; j++)
+			memmove(SWROW(dy + j) + dx, SWROW(sy + j) + sx, w * 4);
+	} else {
+		for(j = h - 1; j >= 0; j--)
+			memmove(SWROW(dy + j) + dx, SWROW(sy + j) + sx, w * 4);
+	}
+}
+
+void
+swflushglyphs(void) {
+	int i;
+
+	for(i = 0; i < LEN(swglyphs); i++) {
+		free(swglyphs[i].alpha);
+		free(swglyphs[i].argb);
+		swglyphs[i] = (Swglyph){ 0 };
+	}
+	nswglyphs = 0;
+}
+
+Swglyph *
+swglyph(XftFont *font, FT_UInt index) {
+	Swglyph *g;
+	FT_Face face;
+	FT_Bitmap *bm;
+	FcBool aa;
+	double px, scale = 1;
+	int i, x, y;
+
+	i = ((uintptr_t)font / sizeof(void *) * 31 + index) % LEN(swglyphs);
+	for(;; i = (i + 1) % LEN(swglyphs)) {
+		g = &swglyphs[i];
+		if(!g->font)
+			break;
+		if(g->font == font && g->index == index)
+			return g;
+	}
+
+	if(nswglyphs >= LEN(swglyphs) * 3 / 4) {
+		swflushglyphs();
+		return swglyph(font, index);
+	}
+
+	if(!(face = XftLockFace(font)))
+		return NULL;
+	if(FcPatternGetBool(font->pattern, FC_ANTIALIAS, 0, &aa) != FcResultMatch)
+		aa = FcTrue;
+
+	nswglyphs++;
+	*g = (Swglyph){ .font = font, .index = index };
+	if(FT_Load_Glyph(face, index, FT_LOAD_RENDER | FT_LOAD_COLOR | (aa
+			? FT_LOAD_TARGET_NORMAL
+			: FT_LOAD_TARGET_MONO | FT_LOAD_MONOCHROME))) {
+		XftUnlockFace(font);
+		return g;
+	}
+
+	bm = &face->glyph->bitmap;
+	if(bm->pixel_mode == FT_PIXEL_MODE_BGRA) {
+		/* colour fonts come in fixed sizes, scaled down to ours */
+		if(FT_HAS_FIXED_SIZES(face) && face->size->metrics.y_ppem
+				&& FcPatternGetDouble(font->pattern,
+				FC_PIXEL_SIZE, 0, &px) == FcResultMatch) {
+			scale = MIN(1, px / face->size->metrics.y_ppem);
+		}
+		g->left = face->glyph->bitmap_left * scale;
+		g->top = face->glyph->bitmap_top * scale;
+		g->advance = (face->glyph->advance.x >> 6) * scale;
+		swcolourglyph(g, bm, scale);
+		XftUnlockFace(font);
+		return g;
+	}
+
+	g->left = face->glyph->bitmap_left;
+	g->top = face->glyph->bitmap_top;
+	g->advance = face->glyph->advance.x >> 6;
+	g->w = bm->width;
+	g->h = bm->rows;
+	g->alpha = xcalloc(MAX(g->w * g->h, 1), 1);
+
+	for(y = 0; y < g->h; y++) {
+		uchar *src = bm->buffer + y * bm->pitch;
+
+		for(x = 0; x < g->w; x++) {
+			if(bm->pixel_mode == FT_PIXEL_MODE_MONO) {
+				g->alpha[y * g->w + x] =
+					(src[x >> 3] & (0x80 >> (x & 7))) ? 255 : 0;
+			} else if(bm->pixel_mode == FT_PIXEL_MODE_GRAY) {
+				g->alpha[y * g->w + x] = src[x];
+			}
+		}
+	}
+	XftUnlockFace(font);
+
+	return g;
+}
+
+/*
+ * Scale the premultiplied BGRA bitmap bm by scale into g, each pixel the
+ * average of the ones it covers.
+ */
+void
+swcolourglyph(Swglyph *g, FT_Bitmap *bm, double scale) {
+	uint32_t sum[4];
+	uchar *src;
+	int x, y, x0, x1, y0, y1, sx, sy, i, n;
+
+	g->w = MAX(1, bm->width * scale + 0.5);
+	g->h = MAX(1, bm->rows * scale + 0.5);
+	g->argb = xmalloc(g->w * g->h * sizeof(*g->argb));
+
+	for(y = 0; y < g->h; y++) {
+		y0 = y * bm->rows / g->h;
+		y1 = MAX(y0 + 1, (y + 1) * bm->rows / g->h);
+		for(x = 0; x < g->w; x++) {
+			x0 = x * bm->width / g->w;
+			x1 = MAX(x0 + 1, (x + 1) * bm->width / g->w);
+			memset(sum, 0, sizeof(sum));
+			for(sy = y0; sy < y1; sy++) {
+				src = bm->buffer + sy * bm->pitch;
+				for(sx = x0; sx < x1; sx++) {
+					for(i = 0; i < 4; i++)
+						sum[i] += src[sx * 4 + i];
+				}
+			}
+			n = (y1 - y0) * (x1 - x0);
+			g->argb[y * g->w + x] = sum[3] / n << 24
+				| sum[2] / n << 16 | sum[1] / n << 8
+				| sum[0] / n;
+		}
+	}
+}
+
+static inline uint32_t
+swblend(uint32_t dst, uint32_t src, uint a) {
+	uint32_t rb, g;
+
+	rb = ((src & 0xff00ff) * a + (dst & 0xff00ff) * (255 - a)) / 255;
+	g = ((src & 0xff00) * a + (dst & 0xff00) * (255 - a)) / 255;
+
+	return (rb & 0xff00ff) | (g & 0xff00);
+}
+
+/* Blend the glyph g with its origin at x, y into the buffer. */
+void
+swglyphdraw(ulong pixel, Swglyph *g, int x, int y) {
+	uint32_t *row;
+	uchar *alpha;
+	uint32_t *argb;
+	int gx, gy, gw, gh, i, j, off;
+	uint a;
+
+	gx = x + g->left, gy = y - g->top, gw = g->w, gh = g->h;
+	if((!g->alpha && !g->argb) || !swclip(&gx, &gy, &gw, &gh))
+		return;
+
+	for(j = 0; j < gh; j++) {
+		row = SWROW(gy + j) + gx;
+		off = (gy + j - (y - g->top)) * g->w + (gx - (x + g->left));
+
+		/* colour glyphs keep their colours, over what is there */
+		if(g->argb) {
+			argb = g->argb + off;
+			for(i = 0; i < gw; i++) {
+				a = argb[i] >> 24;
+				if(a == 255) {
+					row[i] = argb[i] & 0xffffff;
+				} else if(a) {
+					row[i] = swblend(row[i], 0, a)
+						+ (argb[i] & 0xffffff);
+				}
+			}
+			continue;
+		}
+
+		alpha = g->alpha + off;
+		for(i = 0; i < gw; i++) {
+			if(alpha[i] == 255) {
+				row[i] = pixel;
+			} else if(alpha[i]) {
+				row[i] = swblend(row[i], pixel, alpha[i]);
+			}
+		}
+	}
+}
+
+void
+swtext(ulong pixel, XftFont *font, int x, int y, uint32_t *s, int len) {
+	Swglyph *g;
+
+	swsync();
+
+	for(; len > 0; s++, len--) {
+		if(!(g = swglyph(font, XftCharIndex(xw.dpy, font, *s))))
+			continue;
+		swglyphdraw(pixel, g, x, y);
+		x += g->advance;
+	}
+}
+
+#ifdef USE_HARFBUZZ
+/* Draw n glyphs by index, specs giving their place from x, y. */
+void
+xdrawglyphs(Colour *c, XftFont *font, int x, int y, XftGlyphSpec *specs,
+		int n) {
+	XftGlyphSpec buf[256];
+	Swglyph *g;
+	int i, m;
+
+	xdamage(x, y - font->ascent, xw.w - x, font->height);
+	if(!xw.draw)
+		swsync();
+
+	for(; n > 0; specs += m, n -= m) {
+		m = MIN(n, LEN(buf));
+		for(i = 0; i < m; i++) {
+			buf[i] = specs[i];
+			buf[i].x += x;
+			buf[i].y += y;
+		}
+		if(xw.draw) {
+			XftDrawGlyphSpec(xw.draw, c, font, buf, m);
+			continue;
+		}
+		for(i = 0; i < m; i++) {
+			if((g = swglyph(font, buf[i].glyph)))
+				swglyphdraw(c->pixel, g, buf[i].x, buf[i].y);
+		}
+	}
+}
+
+/*
+ * The glyphs HarfBuzz makes of the len code points s in f, each cluster
+ * placed at the start of its cell.  Runs are only shaped again when they
+ * fell out of the cache, or NULL if f cannot be shaped.
+ */
+Shaped *
+xshape(Font *f, uint32_t *s, int len) {
+	hb_glyph_info_t *info;
+	hb_glyph_position_t *pos;
+	Shaped *set, *sh;
+	FT_Face face;
+	uint64_t start;
+	uint32_t h, cluster;
+	unsigned int n;
+	int i, pen;
+
+	h = clusterhash(s, len) ^ (uintptr_t)f->match / sizeof(void *);
+	set = &shaped[h % SHAPESETS * SHAPEWAYS];
+	sh = set;
+	for(i = 0; i < SHAPEWAYS; i++) {
+		if(set[i].font == f->match && set[i].hash == h
+				&& set[i].len == len
+				&& !memcmp(set[i].text, s, len * sizeof(*s))) {
+			set[i].used = ++shapestat.tick;
+			shapestat.hits++;
+			return &set[i];
+		}
+		if(set[i].used < sh->used)
+			sh = &set[i];
+	}
+
+	if(!f->hb) {
+		if(!(face = XftLockFace(f->match)))
+			return NULL;
+		f->hb = hb_ft_font_create(face, NULL);
+	}
+	if(!hbbuf)
+		hbbuf = hb_buffer_create();
+
+	start = monotime();
+	shapestat.misses++;
+
+	hb_buffer_reset(hbbuf);
+	hb_buffer_add_utf32(hbbuf, s, len, 0, len);
+	hb_buffer_guess_segment_properties(hbbuf);
+	hb_shape(f->hb, hbbuf, NULL, 0);
+	info = hb_buffer_get_glyph_infos(hbbuf, &n);
+	pos = hb_buffer_get_glyph_positions(hbbuf, NULL);
+
+	free(sh->text);
+	free(sh->glyphs);
+	*sh = (Shaped){
+		.font = f->match,
+		.hash = h,
+		.text = xmalloc(len * sizeof(*s)),
+		.len = len,
+		.glyphs = xmalloc(MAX(n, 1) * sizeof(XftGlyphSpec)),
+		.nglyphs = n,
+		.used = ++shapestat.tick,
+	};
+	memcpy(sh->text, s, len * sizeof(*s));
+
+	/* a ligature keeps to the cells of its cluster, marks to their base */
+	cluster = n ? info[0].cluster : 0;
+	for(i = 0, pen = 0; i < n; i++) {
+		if(info[i].cluster != cluster) {
+			cluster = info[i].cluster;
+			pen = 0;
+		}
+		sh->glyphs[i].glyph = info[i].codepoint;
+		sh->glyphs[i].x = cluster * f->width
+			+ ((pen + pos[i].x_offset) >> 6);
+		sh->glyphs[i].y = -(pos[i].y_offset >> 6);
+		pen += pos[i].x_advance;
+	}
+
+	statadd(&shapetime, monotime() - start);
+
+	return sh;
+}
+
+/* Forget the runs shaped with font, which is closed. */
+void
+xshapeflush(XftFont *font) {
+	int i;
+
+	for(i = 0; i < LEN(shaped); i++) {
+		if(shaped[i].font != font)
+			continue;
+		free(shaped[i].text);
+		free(shaped[i].glyphs);
+		shaped[i] = (Shaped){ 0 };
+	}
+}
+#endif
+
+void
+xtermclear(int col1, int row1, int col2, int row2) {
+	xdrawrect(&dc.col[IS_SET(focused_term, MODE_REVERSE) ? defaultfg : defaultbg],
+			borderpx + col1 * xw.cw,
+			borderpx + row1 * xw.ch,
+			(col2-col1+1) * xw.cw,
+			(row2-row1+1) * xw.ch);
+}
+
+/*
+ * Absolute coordinates.
+ */
+void
+xclear(int x1, int y1, int x2, int y2) {
+	xdrawrect(&dc.col[IS_SET(focused_term, MODE_REVERSE)? defaultfg : defaultbg],
+			x1, y1, x2-x1, y2-y1);
+}
+
+/*
+ * How far down clearing the borders of row y goes: the end of the row,
+ * or for the last one the bottom of the window unless the bar is there.
+ */
+int
+xedge(int y) {
+	int winy = borderpx + y * xw.ch;
+
+	if(y < focused_term->row-1)
+		return winy + xw.ch;
+	if(y == focused_term->row-1 && BARSHOWN)
+		return winy + xw.ch;
+	return xw.h;
+}
+
+void
+xhints(void) {
+	XClassHint class = {opt_class ? opt_class : termname, termname};
+	XWMHints wm = {.flags = InputHint, .input = 1};
+	XSizeHints *sizeh = NULL;
+
+	sizeh = XAllocSizeHints();
+	if(xw.isfixed == False) {
+		sizeh->flags = PSize | PResizeInc | PBaseSize;
+		sizeh->height = xw.h;
+		sizeh->width = xw.w;
+		sizeh->height_inc = xw.ch;
+		sizeh->width_inc = xw.cw;
+		sizeh->base_height = 2 * borderpx;
+		sizeh->base_width = 2 * borderpx;
+	} else {
+		sizeh->flags = PMaxSize | PMinSize;
+		sizeh->min_width = sizeh->max_width = xw.fw;
+		sizeh->min_height = sizeh->max_height = xw.fh;
+	}
+
+	XSetWMProperties(xw.dpy, xw.win, NULL, NULL, NULL, 0, sizeh, &wm, &class);
+	XFree(sizeh);
+}
+
+int
 xloadfont(Font *f, FcPattern *pattern) {
 	FcPattern *match;
 	FcResult result;
@@ -3057,6 +5217,9 @@ xloadfont(Font *f, FcPattern *pattern) {
 
 	f->set = NULL;
 	f->pattern = FcPatternDuplicate(pattern);
+#ifdef USE_HARFBUZZ
+	f->hb = NULL;
+#endif
 
 	f->ascent = f->match->ascent;
 	f->descent = f->match->descent;
@@ -3066,14 +5229,102 @@ xloadfont(Font *f, FcPattern *pattern) {
 	f->height = f->ascent + f->descent;
 	f->width = f->lbearing + f->rbearing;
 
+	xloadcoverage(f);
+
 	return 0;
 }
 
+static const FcChar32 nopage[FC_CHARSET_MAP_SIZE];
+
+void
+xloadcoverage(Font *f) {
+	FcChar32 map[FC_CHARSET_MAP_SIZE], next, base;
+	FcCharSet *cs = f->match->charset;
+	FcChar32 *page;
+	long u;
+	int i;
+
+	for(i = 0; i < LEN(f->bmp); i++)
+		f->bmp[i] = nopage;
+	f->astral = NULL;
+	f->astralbase = NULL;
+	f->nastral = 0;
+	f->ascii = false;
+
+	if(!cs)
+		return;
+
+	/* fontconfig hands out the set in ascending 256 code point pages */
+	for(base = FcCharSetFirstPage(cs, map, &next);
+			base != FC_CHARSET_DONE;
+			base = FcCharSetNextPage(cs, map, &next)) {
+		if(base < 0x10000) {
+			page = xmalloc(sizeof(map));
+			memcpy(page, map, sizeof(map));
+			f->bmp[base >> 8] = page;
+		} else {
+			f->astral = xrealloc(f->astral,
+					(f->nastral + 1) * sizeof(map));
+			f->astralbase = xrealloc(f->astralbase,
+					(f->nastral + 1) * sizeof(FcChar32));
+			memcpy(f->astral + f->nastral * FC_CHARSET_MAP_SIZE,
+					map, sizeof(map));
+			f->astralbase[f->nastral++] = base;
+		}
+	}
+
+	for(u = 0x20; u < 0x7f && xfonthas(f, u); u++)
+		/* nothing */;
+	f->ascii = (u == 0x7f);
+}
+
+static inline bool
+xfonthas(Font *f, long u) {
+	const FcChar32 *page;
+	int lo, hi, mid;
+
+	if(u < 0x10000) {
+		page = f->bmp[u >> 8];
+	} else {
+		page = NULL;
+		for(lo = 0, hi = f->nastral - 1; lo <= hi;) {
+			mid = (lo + hi) / 2;
+			if(f->astralbase[mid] == (u & ~0xff)) {
+				page = f->astral + mid * FC_CHARSET_MAP_SIZE;
+				break;
+			}
+			if(f->astralbase[mid] < u) {
+				lo = mid + 1;
+			} else {
+				hi = mid - 1;
+			}
+		}
+		if(!page)
+			return false;
+	}
+
+	return (page[(u & 0xff) >> 5] >> (u & 0x1f)) & 1;
+}
+
+void
+xunloadcoverage(Font *f) {
+	int i;
+
+	for(i = 0; i < LEN(f->bmp); i++) {
+		if(f->bmp[i] != nopage)
+			free((void *)f->bmp[i]);
+	}
+	free(f->astral);
+	free(f->astralbase);
+}
+
 void
 xloadfonts(char *fontstr, int fontsize) {
 	FcPattern *pattern;
 	FcResult result;
+	Fontsize *fs;
 	double fontval;
+	int i;
 
 	if(fontstr[0] == '-') {
 		pattern = XftXlfdParse(fontstr, False, False);
@@ -3102,32 +5353,76 @@ xloadfonts(char *fontstr, int fontsize) {
 		}
 	}
 
-	FcConfigSubstitute(0, pattern, FcMatchPattern);
-	FcDefaultSubstitute(pattern);
+	for(fs = NULL, i = 0; i < LEN(fontsizes); i++) {
+		if(fontsizes[i].used && fontsizes[i].size == usedfontsize) {
+			fs = &fontsizes[i];
+			break;
+		}
+		/* otherwise reuse an empty or the least recently used slot */
+		if(!fs || fontsizes[i].used < fs->used)
+			fs = &fontsizes[i];
+	}
 
-	if(xloadfont(&dc.font, pattern))
-		die("st: can't open font %s\n", fontstr);
+	if(!fs->used || fs->size != usedfontsize) {
+		if(fs->used)
+			xunloadfonts(fs);
 
-	/* Setting character width and height. */
-	xw.cw = dc.font.width;
-	xw.ch = dc.font.height;
+		FcConfigSubstitute(0, pattern, FcMatchPattern);
+		FcDefaultSubstitute(pattern);
 
-	FcPatternDel(pattern, FC_SLANT);
-	FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
-	if(xloadfont(&dc.ifont, pattern))
-		die("st: can't open font %s\n", fontstr);
+		if(xloadfont(&fs->font[FRC_NORMAL], pattern))
+			die("st: can't open font %s\n", fontstr);
+		fs->loaded[FRC_NORMAL] = true;
+		fs->size = usedfontsize;
+		fs->pattern = FcPatternDuplicate(pattern);
+	}
+	FcPatternDestroy(pattern);
 
-	FcPatternDel(pattern, FC_WEIGHT);
-	FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
-	if(xloadfont(&dc.ibfont, pattern))
-		die("st: can't open font %s\n", fontstr);
+	fs->used = ++fontsizeuse;
+	dc.fonts = fs;
 
-	FcPatternDel(pattern, FC_SLANT);
-	FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ROMAN);
-	if(xloadfont(&dc.bfont, pattern))
-		die("st: can't open font %s\n", fontstr);
+	/* Setting character width and height. */
+	xw.cw = fs->font[FRC_NORMAL].width;
+	xw.ch = fs->font[FRC_NORMAL].height;
+}
+
+/*
+ * Return the font for a style of the current size, loading it if this is
+ * the first time it is needed. When a style can't be loaded the regular
+ * font is used in its place, and the style is not tried again for this size.
+ */
+Font *
+xgetfont(int flags) {
+	Fontsize *fs = dc.fonts;
+	FcPattern *pattern;
+	int err;
+
+	if(fs->loaded[flags])
+		return &fs->font[flags];
+	if(fs->failed[flags])
+		return &fs->font[FRC_NORMAL];
 
+	pattern = FcPatternDuplicate(fs->pattern);
+	if(flags == FRC_ITALIC || flags == FRC_ITALICBOLD) {
+		FcPatternDel(pattern, FC_SLANT);
+		FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
+	}
+	if(flags == FRC_BOLD || flags == FRC_ITALICBOLD) {
+		FcPatternDel(pattern, FC_WEIGHT);
+		FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
+	}
+	err = xloadfont(&fs->font[flags], pattern);
 	FcPatternDestroy(pattern);
+
+	if(err) {
+		fprintf(stderr, "st: can't open style %d of font %s\n", flags,
+				usedfont);
+		fs->failed[flags] = true;
+		return &fs->font[FRC_NORMAL];
+	}
+	fs->loaded[flags] = true;
+
+	return &fs->font[flags];
 }
 
 int
@@ -3139,8 +5434,528 @@ xloadfontset(Font *f) {
 	return 0;
 }
 
+/*
+ * Use some dozen of Fontconfig calls to get the font for one single
+ * character. This is safe to call from the fallback worker.
+ */
+FcPattern *
+xfallbackmatch(FcPattern *pattern, FcFontSet *set, long c) {
+	FcResult fcres;
+	FcPattern *fcpattern, *fontpattern;
+	FcFontSet *fcsets[] = { set };
+	FcCharSet *fccharset;
+
+	fcpattern = FcPatternDuplicate(pattern);
+	fccharset = FcCharSetCreate();
+
+	FcCharSetAddChar(fccharset, c);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+
+	FcConfigSubstitute(0, fcpattern, FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+
+	fontpattern = FcFontSetMatch(0, fcsets, FcTrue, fcpattern, &fcres);
+
+	FcPatternDestroy(fcpattern);
+	FcCharSetDestroy(fccharset);
+
+	return fontpattern;
+}
+
+/*
+ * Overwrite or create the new cache entry.
+ */
+int
+frcadd(XftFont *font, long c, int flags, int size) {
+	frccur++;
+	frclen++;
+	if(frccur >= LEN(frc))
+		frccur = 0;
+	if(frclen > LEN(frc)) {
+		frclen = LEN(frc);
+		if(!xw.draw)
+			swflushglyphs();
+		XftFontClose(xw.dpy, frc[frccur].font);
+	}
+
+	frc[frccur].font = font;
+	frc[frccur].c = c;
+	frc[frccur].flags = flags;
+	frc[frccur].size = size;
+
+	return frccur;
+}
+
+void *
+xfallbackwork(void *arg) {
+	Fallback *fb;
+	FcFontSet *sets[4] = { NULL };
+	FcPattern *match;
+	FcResult result;
+	int size = -1, i;
+
+	pthread_mutex_lock(&fblock);
+	for(;;) {
+		for(fb = fallbacks; fb; fb = fb->next) {
+			if(fb->state == FB_QUEUED)
+				break;
+		}
+		if(!fb) {
+			pthread_cond_wait(&fbcond, &fblock);
+			continue;
+		}
+		fb->state = FB_RUNNING;
+
+		/* the sorted sets are only valid for one font size */
+		if(fb->size != size) {
+			for(i = 0; i < LEN(sets); i++) {
+				if(sets[i])
+					FcFontSetDestroy(sets[i]);
+				sets[i] = NULL;
+			}
+			size = fb->size;
+		}
+		pthread_mutex_unlock(&fblock);
+
+		if(!sets[fb->flags]) {
+			sets[fb->flags] = FcFontSort(0, fb->pattern, FcTrue,
+					0, &result);
+		}
+		match = sets[fb->flags] ? xfallbackmatch(fb->pattern,
+				sets[fb->flags], fb->c) : NULL;
+
+		pthread_mutex_lock(&fblock);
+		FcPatternDestroy(fb->pattern);
+		fb->pattern = match;
+		fb->state = match ? FB_DONE : FB_FAILED;
+		if(write(fbpipe[1], "", 1) < 0 && errno != EAGAIN)
+			fprintf(stderr, "fallback wakeup failed: %s\n", SERRNO);
+	}
+
+	return NULL;
+}
+
+void
+xfallbackinit(void) {
+	pthread_t thread;
+
+	if(pipe(fbpipe) < 0)
+		die("pipe failed: %s\n", SERRNO);
+	fcntl(fbpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(fbpipe[1], F_SETFL, O_NONBLOCK);
+
+	if(pthread_create(&thread, NULL, xfallbackwork, NULL) != 0)
+		die("Could not start the fallback font thread.\n");
+	pthread_detach(thread);
+}
+
+/* Have the worker look for a font for c, returning how far it got. */
+int
+xfallbackqueue(Font *font, long c, int flags, int size) {
+	Fallback *fb;
+	uint64_t key = FBKEY(c, flags, size);
+	int state;
+
+	if(fbfailed[FBSLOT(key)] == key + 1)
+		return FB_FAILED;
+
+	pthread_mutex_lock(&fblock);
+	for(fb = fallbacks; fb; fb = fb->next) {
+		if(fb->c == c && fb->flags == flags && fb->size == size)
+			break;
+	}
+	if(!fb) {
+		fb = xmalloc(sizeof(Fallback));
+		fb->c = c;
+		fb->flags = flags;
+		fb->size = size;
+		fb->pattern = FcPatternDuplicate(font->pattern);
+		fb->state = FB_QUEUED;
+		fb->next = fallbacks;
+		fallbacks = fb;
+		pthread_cond_signal(&fbcond);
+	}
+	state = fb->state;
+	pthread_mutex_unlock(&fblock);
+
+	return state;
+}
+
+/*
+ * Open the fonts the worker found and redraw what shows a placeholder for
+ * them, or for characters no font has, which the main font now draws.
+ * Placeholders may have been scrolled by blits or drawn in other tabs,
+ * which keep them in their buffers, so every tab is painted again in
+ * full; fonts arriving are rare enough.  Failed lookups leave the list
+ * for fbfailed.
+ */
+void
+xfallbackpoll(void) {
+	Fallback *fb, **prev;
+	Term *term;
+	char buf[64];
+	uint64_t key;
+	bool done = false;
+
+	/* the worker writes to it when it is done with a lookup */
+	while(read(fbpipe[0], buf, sizeof(buf)) > 0)
+		done = true;
+
+	pthread_mutex_lock(&fblock);
+	for(prev = &fallbacks; (fb = *prev);) {
+		if(fb->state == FB_DONE) {
+			XftFont *xfont = XftFontOpenPattern(xw.dpy, fb->pattern);
+
+			if(!xfont) {
+				FcPatternDestroy(fb->pattern);
+				fb->pattern = NULL;
+				fb->state = FB_FAILED;
+			} else {
+				fcacherecord(fb->c, fb->flags, fb->pattern);
+				frcadd(xfont, fb->c, fb->flags, fb->size);
+			}
+		}
+		if(fb->state == FB_FAILED) {
+			key = FBKEY(fb->c, fb->flags, fb->size);
+			fbfailed[FBSLOT(key)] = key + 1;
+		} else if(fb->state != FB_DONE) {
+			prev = &fb->next;
+			continue;
+		}
+		*prev = fb->next;
+		free(fb);
+	}
+	pthread_mutex_unlock(&fblock);
+
+	if(done) {
+		for(term = terms; term; term = term->next)
+			tfulldirt(term);
+	}
+}
+
+static uint64_t
+fnvhash(uint64_t h, const void *p, size_t len) {
+	const uchar *s = p;
+
+	while(len--) {
+		h ^= *s++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/*
+ * The cache is only valid for the same font string, fontconfig version,
+ * configuration files and font directories.
+ */
+static uint64_t
+fcachekey(const char *fontstr) {
+	FcStrList *lists[2], *list;
+	FcChar8 *name;
+	struct stat st;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int version = FcGetVersion(), i;
+
+	h = fnvhash(h, fontstr, strlen(fontstr));
+	h = fnvhash(h, &version, sizeof(version));
+
+	lists[0] = FcConfigGetConfigFiles(NULL);
+	lists[1] = FcConfigGetFontDirs(NULL);
+	for(i = 0; i < LEN(lists); i++) {
+		if(!(list = lists[i]))
+			continue;
+		while((name = FcStrListNext(list))) {
+			h = fnvhash(h, name, strlen((char *)name) + 1);
+			if(!stat((char *)name, &st))
+				h = fnvhash(h, &st.st_mtime, sizeof(st.st_mtime));
+		}
+		FcStrListDone(list);
+	}
+
+	return h;
+}
+
+void
+fcacheload(void) {
+	char *dir = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+	const FcacheHeader *hdr;
+	const FcacheRange *r;
+	struct stat st;
+	size_t len, need;
+	void *map;
+	int fd, i;
+
+	fcache.owner = getpid();
+	fcache.key = fcachekey(usedfont);
+
+	len = PATH_MAX;
+	fcache.path = xmalloc(len);
+	if(dir && *dir) {
+		snprintf(fcache.path, len, "%s/st/fallback-%016llx", dir,
+				(unsigned long long)fcache.key);
+	} else if(home && *home) {
+		snprintf(fcache.path, len, "%s/.cache/st/fallback-%016llx",
+				home, (unsigned long long)fcache.key);
+	} else {
+		free(fcache.path);
+		fcache.path = NULL;
+		return;
+	}
+	atexit(fcachesave);
+
+	if((fd = open(fcache.path, O_RDONLY)) < 0)
+		return;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(FcacheHeader)) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return;
+
+	/*
+	 * The file may be cut short or written by something else, so nothing
+	 * in it is used before it is checked: the counts against the size,
+	 * every offset and index, and the order fcachefind() relies on.
+	 */
+	hdr = map;
+	if(hdr->magic != FCACHE_MAGIC || hdr->version != FCACHE_VERSION
+			|| hdr->key != fcache.key
+			|| hdr->nranges > st.st_size / sizeof(FcacheRange)
+			|| hdr->nfiles > st.st_size / sizeof(uint32_t)) {
+		goto invalid;
+	}
+	need = sizeof(*hdr) + (size_t)hdr->nranges * sizeof(FcacheRange)
+		+ (size_t)hdr->nfiles * sizeof(uint32_t);
+	if(need > st.st_size || ((char *)map)[st.st_size - 1] != '\0')
+		goto invalid;
+
+	fcache.map = map;
+	fcache.maplen = st.st_size;
+	fcache.nranges = hdr->nranges;
+	fcache.nfiles = hdr->nfiles;
+	fcache.ranges = (const FcacheRange *)(hdr + 1);
+	fcache.files = (const uint32_t *)(fcache.ranges + fcache.nranges);
+
+	for(i = 0; i < fcache.nranges; i++) {
+		r = &fcache.ranges[i];
+		if(r->file >= fcache.nfiles || r->flags > FRC_ITALICBOLD
+				|| r->lo > r->hi || r->hi > 0x10FFFF
+				|| r->index < 0) {
+			goto invalid;
+		}
+		/* sorted by style and code point, and apart */
+		if(i > 0 && (r[-1].flags > r->flags
+				|| (r[-1].flags == r->flags
+				&& r[-1].hi >= r->lo))) {
+			goto invalid;
+		}
+	}
+	for(i = 0; i < fcache.nfiles; i++) {
+		if(fcache.files[i] < need || fcache.files[i] >= st.st_size)
+			goto invalid;
+	}
+	return;
+
+invalid:
+	munmap(map, st.st_size);
+	fcache.map = NULL;
+	fcache.nranges = fcache.nfiles = 0;
+}
+
+XftFont *
+fcachefind(Font *font, long c, int flags) {
+	const FcacheRange *r = NULL;
+	const char *file = NULL;
+	FcPattern *fp, *match;
+	XftFont *xfont;
+	int lo, hi, mid, index = 0;
+
+	for(lo = 0, hi = fcache.nranges - 1; lo <= hi;) {
+		mid = (lo + hi) / 2;
+		if(fcache.ranges[mid].flags < flags
+				|| (fcache.ranges[mid].flags == flags
+				&& fcache.ranges[mid].lo <= c)) {
+			r = &fcache.ranges[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if(r && r->flags == flags && BETWEEN(c, r->lo, r->hi)) {
+		file = (const char *)fcache.map + fcache.files[r->file];
+		index = r->index;
+	} else {
+		for(lo = 0; lo < fcache.nadded; lo++) {
+			if(fcache.added[lo].flags == flags
+					&& fcache.added[lo].lo == c) {
+				file = fcache.added[lo].file;
+				index = fcache.added[lo].index;
+				break;
+			}
+		}
+	}
+	if(!file)
+		return NULL;
+
+	/* no matching, just fill in the font file from the cache */
+	fp = FcPatternCreate();
+	FcPatternAddString(fp, FC_FILE, (const FcChar8 *)file);
+	FcPatternAddInteger(fp, FC_INDEX, index);
+	match = FcFontRenderPrepare(NULL, font->pattern, fp);
+	FcPatternDestroy(fp);
+	if(!match)
+		return NULL;
+
+	if(!(xfont = XftFontOpenPattern(xw.dpy, match)))
+		FcPatternDestroy(match);
+
+	return xfont;
+}
+
+void
+fcacherecord(long c, int flags, FcPattern *match) {
+	FcChar8 *file;
+	int index;
+
+	if(!fcache.path || !match)
+		return;
+	if(FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch)
+		return;
+	if(FcPatternGetInteger(match, FC_INDEX, 0, &index) != FcResultMatch)
+		index = 0;
+
+	fcache.added = xrealloc(fcache.added,
+			(fcache.nadded + 1) * sizeof(FcacheEntry));
+	fcache.added[fcache.nadded++] = (FcacheEntry){
+		.lo = c, .hi = c, .flags = flags, .index = index,
+		.file = strdup((char *)file)
+	};
+}
+
+static int
+fcachecmp(const void *a, const void *b) {
+	const FcacheEntry *ea = a, *eb = b;
+
+	if(ea->flags != eb->flags)
+		return ea->flags - eb->flags;
+	return (ea->lo > eb->lo) - (ea->lo < eb->lo);
+}
+
+/*
+ * Merge what this process resolved into the cache, coalescing runs of
+ * code points that went to the same font, and replace the file.
+ */
+void
+fcachesave(void) {
+	FcacheHeader hdr;
+	FcacheRange r;
+	FcacheEntry *all, *e, *last;
+	char **files, tmp[PATH_MAX], *p;
+	uint32_t off;
+	int i, j, n, nfiles;
+	FILE *f;
+
+	if(!fcache.nadded || getpid() != fcache.owner)
+		return;
+
+	all = xmalloc((fcache.nranges + fcache.nadded) * sizeof(FcacheEntry));
+	for(i = 0; i < fcache.nranges; i++) {
+		all[i] = (FcacheEntry){
+			.lo = fcache.ranges[i].lo, .hi = fcache.ranges[i].hi,
+			.flags = fcache.ranges[i].flags,
+			.index = fcache.ranges[i].index,
+			.file = (char *)fcache.map
+				+ fcache.files[fcache.ranges[i].file]
+		};
+	}
+	memcpy(all + i, fcache.added, fcache.nadded * sizeof(FcacheEntry));
+	n = i + fcache.nadded;
+	qsort(all, n, sizeof(FcacheEntry), fcachecmp);
+
+	files = xmalloc(n * sizeof(char *));
+	nfiles = 0;
+	for(i = 0, last = NULL, j = 0; i < n; i++) {
+		e = &all[i];
+		if(last && last->flags == e->flags && last->index == e->index
+				&& e->lo <= last->hi + 1
+				&& !strcmp(last->file, e->file)) {
+			last->hi = MAX(last->hi, e->hi);
+			continue;
+		}
+		/* the loader takes no overlaps, the first font wins */
+		if(last && last->flags == e->flags && e->lo <= last->hi)
+			continue;
+		last = &all[j++];
+		*last = *e;
+	}
+	n = j;
+
+	/* make sure the directories exist, like mkdir -p */
+	snprintf(tmp, sizeof(tmp), "%s", fcache.path);
+	for(p = tmp + 1; (p = strchr(p, '/')); p++) {
+		*p = '\0';
+		mkdir(tmp, 0700);
+		*p = '/';
+	}
+	snprintf(tmp, sizeof(tmp), "%s.%d", fcache.path, (int)getpid());
+	if(!(f = fopen(tmp, "w")))
+		goto out;
+
+	for(i = 0; i < n; i++) {
+		for(j = 0; j < nfiles && strcmp(files[j], all[i].file); j++)
+			/* nothing */;
+		if(j == nfiles)
+			files[nfiles++] = all[i].file;
+	}
+
+	hdr = (FcacheHeader){
+		.magic = FCACHE_MAGIC, .version = FCACHE_VERSION,
+		.key = fcache.key, .nranges = n, .nfiles = nfiles
+	};
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	for(i = 0; i < n; i++) {
+		for(j = 0; strcmp(files[j], all[i].file); j++)
+			/* nothing */;
+		r = (FcacheRange){
+			.lo = all[i].lo, .hi = all[i].hi, .flags = all[i].flags,
+			.file = j, .index = all[i].index
+		};
+		fwrite(&r, sizeof(r), 1, f);
+	}
+	off = sizeof(hdr) + n * sizeof(FcacheRange) + nfiles * sizeof(off);
+	for(i = 0; i < nfiles; i++) {
+		fwrite(&off, sizeof(off), 1, f);
+		off += strlen(files[i]) + 1;
+	}
+	for(i = 0; i < nfiles; i++)
+		fwrite(files[i], strlen(files[i]) + 1, 1, f);
+
+	if(fclose(f) == 0 && rename(tmp, fcache.path) == 0)
+		goto out;
+	unlink(tmp);
+
+out:
+	free(files);
+	free(all);
+}
+
 void
 xunloadfont(Font *f) {
+	xunloadcoverage(f);
+	if(!xw.draw)
+		swflushglyphs();
+#ifdef USE_HARFBUZZ
+	xshapeflush(f->match);
+	if(f->hb) {
+		hb_font_destroy(f->hb);
+		XftUnlockFace(f->match);
+		f->hb = NULL;
+	}
+#endif
 	XftFontClose(xw.dpy, f->match);
 	FcPatternDestroy(f->pattern);
 	if(f->set)
@@ -3148,30 +5963,22 @@ xunloadfont(Font *f) {
 }
 
 void
-xunloadfonts(void) {
-	int i, ip;
+xunloadfonts(Fontsize *fs) {
+	int i;
 
-	/*
-	 * Free the loaded fonts in the font cache. This is done backwards
-	 * from the frccur.
-	 */
-	for(i = 0, ip = frccur; i < frclen; i++, ip--) {
-		if(ip < 0)
-			ip = LEN(frc) - 1;
-		XftFontClose(xw.dpy, frc[ip].font);
+	for(i = 0; i < LEN(fs->font); i++) {
+		if(fs->loaded[i])
+			xunloadfont(&fs->font[i]);
+		fs->loaded[i] = false;
+		fs->failed[i] = false;
 	}
-	frccur = -1;
-	frclen = 0;
-
-	xunloadfont(&dc.font);
-	xunloadfont(&dc.bfont);
-	xunloadfont(&dc.ifont);
-	xunloadfont(&dc.ibfont);
+	FcPatternDestroy(fs->pattern);
+	fs->pattern = NULL;
+	fs->used = 0;
 }
 
 void
 xzoom(const Arg *arg) {
-	xunloadfonts();
 	xloadfonts(usedfont, usedfontsize + arg->i);
 	cresize(0, 0);
 	redraw(0);
@@ -3198,6 +6005,15 @@ xinit(void) {
 
 	usedfont = (opt_font == NULL)? font : opt_font;
 	xloadfonts(usedfont, 0);
+	if(fallbackcache)
+		fcacheload();
+	if(asyncfallback)
+		xfallbackinit();
+	if(showstats) {
+		statowner = getpid();
+		atexit(stats);
+		signal(SIGUSR1, sigstats);
+	}
 
 	/* colors */
 	xw.cmap = XDefaultColormap(xw.dpy, xw.scr);
@@ -3244,13 +6060,28 @@ xinit(void) {
 	gcvalues.graphics_exposures = False;
 	dc.gc = XCreateGC(xw.dpy, parent, GCGraphicsExposures,
 			&gcvalues);
-	xw.buf = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h,
-			DefaultDepth(xw.dpy, xw.scr));
 	XSetForeground(xw.dpy, dc.gc, dc.col[defaultbg].pixel);
-	XFillRectangle(xw.dpy, xw.buf, dc.gc, 0, 0, xw.w, xw.h);
 
-	/* Xft rendering context */
-	xw.draw = XftDrawCreate(xw.dpy, xw.buf, xw.vis, xw.cmap);
+	/* client side renderer, if asked for and the visual allows it */
+	if(softrender && !swinit(xw.w, xw.h)) {
+		fprintf(stderr, "st: software rendering unavailable,"
+				" using Xft\n");
+		softrender = false;
+	}
+
+	if(softrender) {
+		xclear(0, 0, xw.w, xw.h);
+	} else {
+		xw.buf = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h,
+				DefaultDepth(xw.dpy, xw.scr));
+		XFillRectangle(xw.dpy, xw.buf, dc.gc, 0, 0, xw.w, xw.h);
+
+		/* Xft rendering context */
+		xw.draw = XftDrawCreate(xw.dpy, xw.buf, xw.vis, xw.cmap);
+#ifdef USE_PRESENT
+		presentinit();
+#endif
+	}
 
 	/* input methods */
 	if((xw.xim =  XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL) {
@@ -3302,102 +6133,244 @@ xinit(void) {
 	XSync(xw.dpy, 0);
 }
 
-#ifdef USE_BLANK_CURSOR
+#ifdef USE_BLANK_CURSOR
+void
+xcursorblank(void) {
+	if (hidden_cursor) return;
+	hidden_cursor = true;
+	XDefineCursor(xw.dpy, xw.win, blank_cursor);
+	XFlush(xw.dpy);
+}
+
+void
+xcursorunblank(void) {
+	if (!hidden_cursor) return;
+	hidden_cursor = false;
+	XDefineCursor(xw.dpy, xw.win, cursor);
+}
+#endif
+
+void
+boxrect(int x, int y, int w, int h) {
+	if(w <= 0 || h <= 0)
+		return;
+	if(boxes.n == LEN(boxes.r))
+		boxflush();
+	boxes.r[boxes.n++] = (XRectangle){ x, y, w, h };
+}
+
+/* A line from from to to along the cell at x, y, at across it, t thick */
+void
+boxline(bool vert, int x, int y, int from, int to, int at, int t) {
+	if(vert)
+		boxrect(x + at, y + from, t, to - from);
+	else
+		boxrect(x + from, y + at, to - from, t);
+}
+
+void
+boxflush(void) {
+	int i;
+
+	if(boxes.n)
+		xdrawrects(boxes.c, boxes.r, boxes.n);
+	boxes.n = 0;
+	for(i = 0; i < LEN(boxes.shade); i++) {
+		if(boxes.nshade[i])
+			xdrawshades(boxes.c, i, boxes.shade[i], boxes.nshade[i]);
+		boxes.nshade[i] = 0;
+	}
+}
+
+/*
+ * Draw the box drawing character or block element u in c, into the cell
+ * of w by h pixels at x, y.  The rectangles are only queued, boxflush()
+ * fills them.
+ */
 void
-xcursorblank(void) {
-	if (hidden_cursor) return;
-	hidden_cursor = true;
-	XDefineCursor(xw.dpy, xw.win, blank_cursor);
-	XFlush(xw.dpy);
+xdrawbox(Colour *c, int x, int y, int w, int h, uint32_t u) {
+	int i, j, q, lw = MAX(1, (w + 2) / 8);
+
+	if(c != boxes.c) {
+		boxflush();
+		boxes.c = c;
+	}
+
+	if(u < 0x2580) {
+		if(!BETWEEN(u, 0x2571, 0x2573)) {
+			boxlines(x, y, w, h, boxarms[u - 0x2500]);
+			return;
+		}
+		for(j = 0; j < h; j++) {
+			i = j * (w - lw) / MAX(1, h - 1);
+			if(u != 0x2571)
+				boxrect(x + i, y + j, lw, 1);
+			if(u != 0x2572)
+				boxrect(x + w - lw - i, y + j, lw, 1);
+		}
+		return;
+	}
+
+	if(u == 0x2580) {
+		/* upper half */
+		boxrect(x, y, w, h / 2);
+	} else if(u <= 0x2588) {
+		/* lower eighths */
+		j = h * (0x2588 - u) / 8;
+		boxrect(x, y + j, w, h - j);
+	} else if(u <= 0x258f) {
+		/* left eighths */
+		boxrect(x, y, w * (0x2590 - u) / 8, h);
+	} else if(u == 0x2590) {
+		/* right half */
+		boxrect(x + w / 2, y, w - w / 2, h);
+	} else if(u <= 0x2593) {
+		/* shades, a quarter to three quarters of the pixels */
+		i = u - 0x2591;
+		if(boxes.nshade[i] == LEN(boxes.shade[i]))
+			boxflush();
+		boxes.shade[i][boxes.nshade[i]++] = (XRectangle){ x, y, w, h };
+	} else if(u == 0x2594) {
+		/* upper eighth */
+		boxrect(x, y, w, h - h * 7 / 8);
+	} else if(u == 0x2595) {
+		/* right eighth */
+		boxrect(x + w * 7 / 8, y, w - w * 7 / 8, h);
+	} else {
+		q = boxquads[u - 0x2596];
+		if(q & 1)
+			boxrect(x, y, w / 2, h / 2);
+		if(q & 2)
+			boxrect(x + w / 2, y, w - w / 2, h / 2);
+		if(q & 4)
+			boxrect(x, y + h / 2, w / 2, h - h / 2);
+		if(q & 8)
+			boxrect(x + w / 2, y + h / 2, w - w / 2, h - h / 2);
+	}
 }
 
+/*
+ * The lines of a box drawing character, arms as in boxarms.  Each arm
+ * runs from its edge of the cell to the lines across it; double lines
+ * stop short of each other where they join.
+ */
 void
-xcursorunblank(void) {
-	if (!hidden_cursor) return;
-	hidden_cursor = false;
-	XDefineCursor(xw.dpy, xw.win, cursor);
+boxlines(int x, int y, int w, int h, uint arms) {
+	int lw = MAX(1, (w + 2) / 8), wt[4], thick[4];
+	int i, j, k, n, m, p, t, at, from, to, c0, c1, dashes = arms >> 8;
+	bool vert, pdouble;
+
+	for(i = 0; i < 4; i++) {
+		wt[i] = arms >> i * 2 & 3;
+		thick[i] = wt[i] == BOX_HEAVY ? 2 * lw : wt[i] ? lw : 0;
+	}
+
+	for(i = 0; i < 4; i++) {
+		if(!wt[i])
+			continue;
+		vert = i & 1;
+		n = vert ? h : w;
+		m = vert ? w : h;
+		/* the arms across, p on the left or top side and p + 2 */
+		p = !vert;
+		pdouble = wt[p] == BOX_DOUBLE || wt[p + 2] == BOX_DOUBLE;
+
+		/* where along this arm the lines across it are */
+		if(pdouble) {
+			c0 = (n - lw) / 2 - lw;
+			c1 = c0 + 3 * lw;
+		} else {
+			t = MAX(thick[p], thick[p + 2]);
+			if(!t)
+				t = wt[i] == BOX_DOUBLE ? lw : thick[i];
+			c0 = (n - t) / 2;
+			c1 = c0 + t;
+		}
+
+		for(k = -1; k <= 1; k++) {
+			if(wt[i] == BOX_DOUBLE ? !k : k)
+				continue;
+			t = wt[i] == BOX_DOUBLE ? lw : thick[i];
+			at = (m - t) / 2 + k * lw;
+
+			if(dashes) {
+				/* only whole lines are dashed */
+				if(i >= 2)
+					continue;
+				for(j = 0; j < dashes; j++) {
+					from = j * n / dashes;
+					to = (j + 1) * n / dashes;
+					boxline(vert, x, y, from,
+							from + MAX(1, (to - from + 1) / 2),
+							at, t);
+				}
+				continue;
+			}
+
+			from = i < 2 ? 0 : c0;
+			to = i < 2 ? c1 : n;
+			if(wt[i] == BOX_DOUBLE && pdouble && wt[p + (k > 0) * 2]) {
+				/* the inner corner of two double lines */
+				if(i < 2)
+					to = c0;
+				else
+					from = c1;
+			} else if(wt[i] != BOX_DOUBLE && pdouble && !wt[(i + 2) % 4]
+					&& wt[p] && wt[p + 2]) {
+				/* a single line meets the near one of a double */
+				if(i < 2)
+					to = c0 + lw;
+				else
+					from = c1 - lw;
+			}
+			boxline(vert, x, y, from, to, at, t);
+		}
+	}
 }
-#endif
 
 void
-xdraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
+xdraws(uint32_t *s, Glyph base, Palette *pal, int x, int y, int len) {
+	int cells = base.mode & ATTR_WIDE ? 2 : 1;
 	int winx = borderpx + x * xw.cw, winy = borderpx + y * xw.ch,
-	    width = charlen * xw.cw, xp, i;
+	    width = len * cells * xw.cw, xp, i, n, cw;
 	int frp, frcflags;
-	int u8fl, u8fblen, u8cblen, doesexist;
-	char *u8c, *u8fs;
-	long u8char;
-	Font *font = &dc.font;
-	FcResult fcres;
-	FcPattern *fcpattern, *fontpattern;
-	FcFontSet *fcsets[] = { NULL };
-	FcCharSet *fccharset;
-	Colour *fg, *bg, *temp, revfg, revbg;
-	XRenderColor colfg, colbg;
-	Rectangle r;
+	uint32_t u, *str;
+	Cluster *cl;
+	Font *font;
+	XftFont *xf;
+	FcPattern *fontpattern;
+	XftFont *fcfont;
+	Colour *fg, *bg, *temp;
 
 	frcflags = FRC_NORMAL;
 
 	if(base.mode & ATTR_ITALIC) {
 		if(base.fg == defaultfg)
 			base.fg = defaultitalic;
-		font = &dc.ifont;
 		frcflags = FRC_ITALIC;
 	} else if((base.mode & ATTR_ITALIC) && (base.mode & ATTR_BOLD)) {
 		if(base.fg == defaultfg)
 			base.fg = defaultitalic;
-		font = &dc.ibfont;
 		frcflags = FRC_ITALICBOLD;
 	} else if(base.mode & ATTR_UNDERLINE) {
 		if(base.fg == defaultfg)
 			base.fg = defaultunderline;
 	}
-	fg = &dc.col[base.fg];
-	bg = &dc.col[base.bg];
-
 	if(base.mode & ATTR_BOLD) {
-		if(BETWEEN(base.fg, 0, 7)) {
-			/* basic system colors */
-			fg = &dc.col[base.fg + 8];
-		} else if(BETWEEN(base.fg, 16, 195)) {
-			/* 256 colors */
-			fg = &dc.col[base.fg + 36];
-		} else if(BETWEEN(base.fg, 232, 251)) {
-			/* greyscale */
-			fg = &dc.col[base.fg + 4];
-		}
-		/*
-		 * Those ranges will not be brightened:
-		 *	8 - 15 – bright system colors
-		 *	196 - 231 – highest 256 color cube
-		 *	252 - 255 – brightest colors in greyscale
-		 */
-		font = &dc.bfont;
+		if(!(base.fg & TRUECOL))
+			base.fg = dc.bright[base.fg];
 		frcflags = FRC_BOLD;
 	}
+	font = xgetfont(frcflags);
 
 	if(IS_SET(focused_term, MODE_REVERSE)) {
-		if(fg == &dc.col[defaultfg]) {
-			fg = &dc.col[defaultbg];
-		} else {
-			colfg.red = ~fg->color.red;
-			colfg.green = ~fg->color.green;
-			colfg.blue = ~fg->color.blue;
-			colfg.alpha = fg->color.alpha;
-			XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &revfg);
-			fg = &revfg;
-		}
-
-		if(bg == &dc.col[defaultbg]) {
-			bg = &dc.col[defaultfg];
-		} else {
-			colbg.red = ~bg->color.red;
-			colbg.green = ~bg->color.green;
-			colbg.blue = ~bg->color.blue;
-			colbg.alpha = bg->color.alpha;
-			XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &revbg);
-			bg = &revbg;
-		}
+		fg = base.fg == defaultfg ? &dc.col[defaultbg]
+			: xcolour(base.fg, pal, 1);
+		bg = base.bg == defaultbg ? &dc.col[defaultfg]
+			: xcolour(base.bg, pal, 1);
+	} else {
+		fg = xcolour(base.fg, pal, 0);
+		bg = xcolour(base.bg, pal, 0);
 	}
 
 	if(base.mode & ATTR_REVERSE) {
@@ -3410,81 +6383,103 @@ xdraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
 		fg = bg;
 
 	/* Intelligent cleaning up of the borders. */
-	if(x == 0) {
-		xclear(0, (y == 0)? 0 : winy, borderpx,
-			winy + xw.ch + ((y >= focused_term->row-1)? xw.h : 0));
-	}
-	if(x + charlen >= focused_term->col) {
-		xclear(winx + width, (y == 0)? 0 : winy, xw.w,
-			((y >= focused_term->row-1)? xw.h : (winy + xw.ch)));
-	}
+	if(x == 0)
+		xclear(0, (y == 0)? 0 : winy, borderpx, xedge(y));
+	if(x + len * cells >= focused_term->col)
+		xclear(winx + width, (y == 0)? 0 : winy, xw.w, xedge(y));
 	if(y == 0)
 		xclear(winx, 0, winx + width, borderpx);
-	if(y == focused_term->row-1)
-		xclear(winx, winy + xw.ch, winx + width, xw.h);
+	if(xedge(y) > winy + xw.ch)
+		xclear(winx, winy + xw.ch, winx + width, xedge(y));
 
 	/* Clean up the region we want to draw to. */
-	XftDrawRect(xw.draw, bg, winx, winy, width, xw.ch);
+	xdrawrect(bg, winx, winy, width, xw.ch);
 
 	/* Set the clip region because Xft is sometimes dirty. */
-	r.x = 0;
-	r.y = 0;
-	r.height = xw.ch;
-	r.width = width;
-	XftDrawSetClipRectangles(xw.draw, winx, winy, &r, 1);
+	xsetclip(winx, winy, width, xw.ch);
+
+	xp = winx;
+	cw = font->width * cells;
+
+	/*
+	 * A run of printable ASCII the main font fully covers is drawn as
+	 * is, without decoding it one character at a time.
+	 */
+	if(font->ascii && cells == 1) {
+		for(i = 0; i < len && BETWEEN(s[i], 0x20, 0x7e); i++)
+			/* nothing */;
+		if(i == len) {
+			xdrawrun(fg, font, xp,
+					winy + font->ascent, s, len);
+#ifdef FORCE_BOLD
+			if ((base.mode & ATTR_BOLD) && forcebold) {
+				xdrawrun(fg, font,
+						xp + 1, winy + font->ascent,
+						s, len);
+			}
+#endif
+			len = 0;
+		}
+	}
 
-	for(xp = winx; bytelen > 0;) {
+	while(len > 0) {
 		/*
-		 * Search for the range in the to be printed string of glyphs
-		 * that are in the main font. Then print that range. If
-		 * some glyph is found that is not in the font, do the
-		 * fallback dance.
+		 * Print the longest range of glyphs that are in the main
+		 * font. If some glyph is found that is not in the font, do
+		 * the fallback dance.  No font has a CLUSTER handle, so
+		 * clusters end the range too.
 		 */
-		u8fs = s;
-		u8fblen = 0;
-		u8fl = 0;
-		for(;;) {
-			u8c = s;
-			u8cblen = utf8decode(s, &u8char);
-			s += u8cblen;
-			bytelen -= u8cblen;
-
-			doesexist = XftCharIndex(xw.dpy, font->match, u8char);
-			if(!doesexist || bytelen <= 0) {
-				if(bytelen <= 0) {
-					if(doesexist) {
-						u8fl++;
-						u8fblen += u8cblen;
-					}
-				}
-
-				if(u8fl > 0) {
-					XftDrawStringUtf8(xw.draw, fg,
-							font->match, xp,
-							winy + font->ascent,
-							(FcChar8 *)u8fs,
-							u8fblen);
+		/* wide ones are placed one at a time, in their two cells */
+		n = cells > 1 ? 1 : len;
+		for(i = 0; i < n && xfonthas(font, s[i]) && !ISBOX(s[i]); i++)
+			/* nothing */;
+		if(i > 0) {
+			xdrawrun(fg, font, xp,
+					winy + font->ascent, s, i);
 #ifdef FORCE_BOLD
-					if ((base.mode & ATTR_BOLD) && forcebold) {
-						XftDrawStringUtf8(xw.draw, fg,
-								font->match, xp + 1,
-								winy + font->ascent,
-								(FcChar8 *)u8fs,
-								u8fblen);
-						xp++;
-					}
+			if ((base.mode & ATTR_BOLD) && forcebold) {
+				xdrawrun(fg, font, xp + 1,
+						winy + font->ascent, s, i);
+				xp++;
+			}
 #endif
-					xp += font->width * u8fl;
+			xp += cw * i;
+			s += i;
+			len -= i;
+			continue;
+		}
+		u = *s++;
+		len--;
+		str = &u;
+		n = 1;
+
+		if(ISBOX(u)) {
+			xdrawbox(fg, xp, winy, cw, xw.ch, u);
+			xp += cw;
+			continue;
+		}
 
+		/* a cluster is drawn whole, in the font of its first one */
+		if(u & CLUSTER) {
+			cl = &focused_term->clusters[u & ~CLUSTER];
+			str = cl->u;
+			n = cl->n;
+			u = str[0];
+			if(xfonthas(font, u)) {
+				xdrawrun(fg, font, xp,
+						winy + font->ascent, str, n);
+#ifdef FORCE_BOLD
+				if ((base.mode & ATTR_BOLD) && forcebold) {
+					xdrawrun(fg, font, xp + 1,
+							winy + font->ascent,
+							str, n);
+					xp++;
 				}
-				break;
+#endif
+				xp += cw;
+				continue;
 			}
-
-			u8fl++;
-			u8fblen += u8cblen;
 		}
-		if(doesexist)
-			break;
 
 		frp = frccur;
 		/* Search the font cache. */
@@ -3492,97 +6487,85 @@ xdraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
 			if(frp <= 0)
 				frp = LEN(frc) - 1;
 
-			if(frc[frp].c == u8char
-					&& frc[frp].flags == frcflags) {
+			if(frc[frp].c == u
+					&& frc[frp].flags == frcflags
+					&& frc[frp].size == dc.fonts->size) {
 				break;
 			}
 		}
 
 		/* Nothing was found. */
-		if(i >= frclen) {
-			if(!font->set)
-				xloadfontset(font);
-			fcsets[0] = font->set;
-
-			/*
-			 * Nothing was found in the cache. Now use
-			 * some dozen of Fontconfig calls to get the
-			 * font for one single character.
-			 */
-			fcpattern = FcPatternDuplicate(font->pattern);
-			fccharset = FcCharSetCreate();
-
-			FcCharSetAddChar(fccharset, u8char);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET,
-					fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE,
-					FcTrue);
-
-			FcConfigSubstitute(0, fcpattern,
-					FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-
-			fontpattern = FcFontSetMatch(0, fcsets,
-					FcTrue, fcpattern, &fcres);
-
-			/*
-			 * Overwrite or create the new cache entry.
-			 */
-			frccur++;
-			frclen++;
-			if(frccur >= LEN(frc))
-				frccur = 0;
-			if(frclen > LEN(frc)) {
-				frclen = LEN(frc);
-				XftFontClose(xw.dpy, frc[frccur].font);
+		if(i >= frclen && (fcfont = fcachefind(font, u, frcflags))) {
+			frp = frcadd(fcfont, u, frcflags,
+					dc.fonts->size);
+		} else if(i >= frclen) {
+			if(asyncfallback && xfallbackqueue(font, u, frcflags,
+					dc.fonts->size) == FB_FAILED) {
+				/* no font has it, let the main one show that */
+				frp = -1;
+			} else if(asyncfallback) {
+				/*
+				 * Let the worker find the font and draw a
+				 * box until it is ready.
+				 */
+				rows.nokeep = true;
+				xdrawrect(fg, xp, winy,
+						cw, 1);
+				xdrawrect(fg, xp, winy,
+						1, xw.ch);
+				xdrawrect(fg, xp + cw - 1,
+						winy, 1, xw.ch);
+				xdrawrect(fg, xp, winy + xw.ch - 1,
+						cw, 1);
+				xp += cw;
+				continue;
+			} else {
+				if(!font->set)
+					xloadfontset(font);
+
+				fontpattern = xfallbackmatch(font->pattern,
+						font->set, u);
+				fcacherecord(u, frcflags, fontpattern);
+				frp = frcadd(XftFontOpenPattern(xw.dpy,
+							fontpattern),
+						u, frcflags, dc.fonts->size);
 			}
-
-			frc[frccur].font = XftFontOpenPattern(xw.dpy,
-					fontpattern);
-			frc[frccur].c = u8char;
-			frc[frccur].flags = frcflags;
-
-			FcPatternDestroy(fcpattern);
-			FcCharSetDestroy(fccharset);
-
-			frp = frccur;
 		}
+		xf = frp < 0 ? font->match : frc[frp].font;
 
-		XftDrawStringUtf8(xw.draw, fg, frc[frp].font,
-				xp, winy + frc[frp].font->ascent,
-				(FcChar8 *)u8c, u8cblen);
+		xdrawtext(fg, xf, xp, winy + xf->ascent, str, n);
 
 #ifdef FORCE_BOLD
 		if ((base.mode & ATTR_BOLD) && forcebold) {
-			XftDrawStringUtf8(xw.draw, fg, frc[frp].font,
-					xp + 1, winy + frc[frp].font->ascent,
-					(FcChar8 *)u8c, u8cblen);
+			xdrawtext(fg, xf, xp + 1, winy + xf->ascent, str, n);
 			xp++;
 		}
 #endif
 
-		xp += font->width;
+		xp += cw;
 	}
 
+	boxflush();
+
 	/*
-	XftDrawStringUtf8(xw.draw, fg, font->set, winx,
-			winy + font->ascent, (FcChar8 *)s, bytelen);
+	xdrawtext(fg, font->set, winx,
+			winy + font->ascent, s, len);
 	*/
 
 	if(base.mode & ATTR_UNDERLINE) {
-		XftDrawRect(xw.draw, fg, winx, winy + font->ascent + 1,
+		xdrawrect(fg, winx, winy + font->ascent + 1,
 				width, 1);
 	}
 
 	/* Reset clip to none. */
-	XftDrawSetClip(xw.draw, 0);
+	xsetclip(0, 0, 0, 0);
 }
 
 void
 xdrawcursor(void) {
-	static int oldx = 0, oldy = 0;
-	int sl;
-	Glyph g = {{' '}, ATTR_NULL, defaultbg, defaultcs};
+	int oldx = xw.curx, oldy = xw.cury;
+	int cx = focused_term->c.x, cy = focused_term->c.y, w;
+	Glyph g = {' ', ATTR_NULL, defaultbg, defaultcs};
 
 	LIMIT(oldx, 0, focused_term->col-1);
 	LIMIT(oldy, 0, focused_term->row-1);
@@ -3596,12 +6579,20 @@ xdrawcursor(void) {
 		return;
 	}
 
-	memcpy(g.c, focused_term->line[focused_term->c.y][focused_term->c.x].c, UTF_SIZ);
+	/* the cursor covers both cells of a wide character */
+	if(oldx > 0 && TMODE(focused_term, oldy)[oldx] & ATTR_WDUMMY)
+		oldx--;
+	if(cx > 0 && TMODE(focused_term, cy)[cx] & ATTR_WDUMMY)
+		cx--;
+	g.u = focused_term->line[cy][cx];
+	g.mode |= TMODE(focused_term, cy)[cx] & ATTR_WIDE;
+	w = (g.mode & ATTR_WIDE ? 2 : 1) * xw.cw;
 
 	/* remove the old cursor */
-	sl = utf8size(focused_term->line[oldy][oldx].c);
-	xdraws(focused_term->line[oldy][oldx].c, focused_term->line[oldy][oldx], oldx,
-			oldy, 1, sl);
+	xdraws(&focused_term->line[oldy][oldx],
+			lget(focused_term->line[oldy], focused_term->col, oldx),
+			LINEPAL(focused_term->line[oldy], focused_term->col),
+			oldx, oldy, 1);
 
 	/* draw the new one */
 	if(!(IS_SET(focused_term, MODE_HIDE))) {
@@ -3612,27 +6603,26 @@ xdrawcursor(void) {
 				g.bg = defaultfg;
 			}
 
-			sl = utf8size(g.c);
-			xdraws(g.c, g, focused_term->c.x, focused_term->c.y, 1, sl);
+			xdraws(&g.u, g, NULL, cx, cy, 1);
 		} else {
-			XftDrawRect(xw.draw, &dc.col[defaultcs],
-					borderpx + focused_term->c.x * xw.cw,
-					borderpx + focused_term->c.y * xw.ch,
-					xw.cw - 1, 1);
-			XftDrawRect(xw.draw, &dc.col[defaultcs],
-					borderpx + focused_term->c.x * xw.cw,
-					borderpx + focused_term->c.y * xw.ch,
+			xdrawrect(&dc.col[defaultcs],
+					borderpx + cx * xw.cw,
+					borderpx + cy * xw.ch,
+					w - 1, 1);
+			xdrawrect(&dc.col[defaultcs],
+					borderpx + cx * xw.cw,
+					borderpx + cy * xw.ch,
 					1, xw.ch - 1);
-			XftDrawRect(xw.draw, &dc.col[defaultcs],
-					borderpx + (focused_term->c.x + 1) * xw.cw - 1,
-					borderpx + focused_term->c.y * xw.ch,
+			xdrawrect(&dc.col[defaultcs],
+					borderpx + cx * xw.cw + w - 1,
+					borderpx + cy * xw.ch,
 					1, xw.ch - 1);
-			XftDrawRect(xw.draw, &dc.col[defaultcs],
-					borderpx + focused_term->c.x * xw.cw,
-					borderpx + (focused_term->c.y + 1) * xw.ch - 1,
-					xw.cw, 1);
+			xdrawrect(&dc.col[defaultcs],
+					borderpx + cx * xw.cw,
+					borderpx + (cy + 1) * xw.ch - 1,
+					w, 1);
 		}
-		oldx = focused_term->c.x, oldy = focused_term->c.y;
+		xw.curx = cx, xw.cury = cy;
 	}
 }
 
@@ -3654,17 +6644,44 @@ xresettitle(void) {
 
 void
 xmove(int dx, int dy, int sx, int sy, int w, int h) {
-	XCopyArea(xw.dpy, xw.buf, xw.buf, dc.gc,
-		(sx*xw.cw) + borderpx, (sy*xw.ch) + borderpx,
-		(w*xw.cw) + borderpx, (h*xw.ch) + borderpx,
+	xcopy((sx*xw.cw) + borderpx, (sy*xw.ch) + borderpx,
+		w*xw.cw, h*xw.ch,
 		(dx*xw.cw) + borderpx, (dy*xw.ch) + borderpx);
 }
 
+/*
+ * Copy the cells the terminal shifted since the last frame, in the
+ * order it did.  What was exposed by them is dirty and painted later.
+ */
+void
+drawmoves(void) {
+	Move *m;
+	int i;
+
+	for(i = 0; i < focused_term->nmoves; i++) {
+		m = &focused_term->moves[i];
+		xmove(m->x1 + MAX(m->dx, 0), m->y1 + MAX(m->dy, 0),
+			m->x1 + MAX(-m->dx, 0), m->y1 + MAX(-m->dy, 0),
+			m->x2 - m->x1 + 1 - abs(m->dx),
+			m->y2 - m->y1 + 1 - abs(m->dy));
+
+		/* the cursor went along, remove it where it is now */
+		if(BETWEEN(xw.curx, m->x1, m->x2)
+				&& BETWEEN(xw.cury, m->y1, m->y2)
+				&& BETWEEN(xw.curx + m->dx, m->x1, m->x2)
+				&& BETWEEN(xw.cury + m->dy, m->y1, m->y2)) {
+			xw.curx += m->dx, xw.cury += m->dy;
+		}
+	}
+	focused_term->nmoves = 0;
+}
+
 void
 redraw(int timeout) {
 	struct timespec tv = {0, timeout * 1000};
 
 	tfulldirt(focused_term);
+	barlost = true;
 	draw();
 
 	if(timeout > 0) {
@@ -3675,12 +6692,9 @@ redraw(int timeout) {
 
 void
 draw(void) {
-#ifdef OPTIMIZE_RENDER
-	focused_term->swapped_lines = false;
-#endif
+	drawmoves();
 	drawregion(0, 0, focused_term->col, focused_term->row);
-	XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, xw.w,
-			xw.h, 0, 0);
+	xpresentdamage();
 	XSetForeground(xw.dpy, dc.gc,
 			dc.col[IS_SET(focused_term, MODE_REVERSE)?
 				defaultfg : defaultbg].pixel);
@@ -3688,10 +6702,13 @@ draw(void) {
 
 void
 drawregion(int x1, int y1, int x2, int y2) {
-	int ic, ib, x, y, ox, sl;
-	Glyph base, new;
-	char buf[DRAW_BUF_SIZ];
-	bool ena_sel = sel.bx != -1;
+	int ib, x, y, rx, sx, ex;
+	Glyph base;
+	Palette *pal;
+	uint32_t buf[DRAW_BUF_SIZ], *l, *cp;
+	ushort *mp, m;
+	uint64_t h, check = 0;
+	bool ena_sel = sel.bx != -1, rowsel;
 
 	if(sel.alt ^ IS_SET(focused_term, MODE_ALTSCREEN))
 		ena_sel = 0;
@@ -3700,34 +6717,66 @@ drawregion(int x1, int y1, int x2, int y2) {
 		return;
 
 	for(y = y1; y < y2; y++) {
-		if(!focused_term->dirty[y])
+		if(!ISDIRTY(focused_term, y))
 			continue;
+		rowsel = ena_sel && SELROW(y);
 
-		xtermclear(0, y, focused_term->col, y);
-		focused_term->dirty[y] = 0;
-		base = focused_term->line[y][0];
-		ic = ib = ox = 0;
-		for(x = x1; x < x2; x++) {
-			new = focused_term->line[y][x];
-			if(ena_sel && selected(x, y))
-				new.mode ^= ATTR_REVERSE;
-			if(ib > 0 && (ATTRCMP(base, new)
-					|| ib >= DRAW_BUF_SIZ-UTF_SIZ)) {
-				xdraws(buf, base, ox, y, ic, ib);
-				ic = ib = 0;
-			}
-			if(ib == 0) {
-				ox = x;
-				base = new;
+		sx = MAX(focused_term->dirty[y].x1, x1);
+		ex = MIN(focused_term->dirty[y].x2 + 1, x2);
+		focused_term->dirty[y] = (Dirty){ 0, -1 };
+		if(sx >= ex)
+			continue;
+
+		l = focused_term->line[y];
+		cp = LINECOL(l, focused_term->col);
+		mp = LINEMODE(l, focused_term->col);
+
+		/* wide characters are drawn whole */
+		if(sx > 0 && mp[sx] & ATTR_WDUMMY)
+			sx--;
+		if(ex < focused_term->col && mp[ex-1] & ATTR_WIDE)
+			ex++;
+
+		/* a whole row may have been drawn before */
+		h = sx == 0 && ex == focused_term->col
+			? xrowhash(y, rowsel, &check) : 0;
+		if(h && xrowload(h, check, y))
+			continue;
+
+		/* the last column also clears the border behind it */
+		xtermclear(sx, y, ex == focused_term->col ? ex : ex-1, y);
+		pal = LINEPAL(l, focused_term->col);
+		for(x = sx; x < ex; x = rx) {
+			base = lget(l, focused_term->col, x);
+			if(rowsel && selected(x, y))
+				base.mode ^= ATTR_REVERSE;
+
+			/* a run of narrow cells is drawn from the line itself */
+			if(!rowsel && !(base.mode & ATTR_WIDE)) {
+				for(rx = x + 1; rx < ex && mp[rx] == mp[x]
+						&& cp[rx] == cp[x]; rx++)
+					/* nothing */;
+				xdraws(&l[x], base, pal, x, y, rx - x);
+				continue;
 			}
 
-			sl = utf8size(new.c);
-			memcpy(buf+ib, new.c, sl);
-			ib += sl;
-			++ic;
+			/* else without the second halves of wide characters */
+			for(ib = 0, rx = x; rx < ex; rx++) {
+				if(mp[rx] & ATTR_WDUMMY)
+					continue;
+				m = mp[rx];
+				if(rowsel && selected(rx, y))
+					m ^= ATTR_REVERSE;
+				if(m != base.mode || cp[rx] != cp[x]
+						|| ib == DRAW_BUF_SIZ) {
+					break;
+				}
+				buf[ib++] = l[rx];
+			}
+			xdraws(buf, base, pal, x, y, ib);
 		}
-		if(ib > 0)
-			xdraws(buf, base, ox, y, ic, ib);
+		if(h)
+			xrowsave(h, check, y);
 	}
 
 	xdrawcursor();
@@ -3736,14 +6785,41 @@ drawregion(int x1, int y1, int x2, int y2) {
 
 void
 xdrawbar(void) {
-	if (autohide) {
-		if (!terms->next) return;
+	int bary = borderpx + focused_term->row * xw.ch;
+
+	if (!BARSHOWN) return;
+
+	/* unchanged, so the back buffer or barpix still has it */
+	if (clicked_bar == -1 && bardrawn == bargen && (!barlost || barpix)) {
+		if (barlost) {
+			xdamage(0, bary, xw.w, xw.ch);
+			XCopyArea(xw.dpy, barpix, xw.buf, dc.gc, 0, 0,
+					xw.w, xw.ch, 0, bary);
+			barlost = false;
+		}
+		return;
+	}
+	bardrawn = bargen;
+	barlost = false;
+
+	xrenderbar();
+
+	if (xw.draw) {
+		if (!barpix) {
+			barpix = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.ch,
+					DefaultDepth(xw.dpy, xw.scr));
+		}
+		XCopyArea(xw.dpy, xw.buf, barpix, dc.gc, 0, bary,
+				xw.w, xw.ch, 0, 0);
 	}
+}
 
+void
+xrenderbar(void) {
 	int i = 0;
 	int drawn = 1;
 	Term *term;
-	Glyph attr = {{' '}, ATTR_NULL, defaultbarfg, defaultbarbg};
+	Glyph attr = {' ', ATTR_NULL, defaultbarfg, defaultbarbg};
 	char buf[60];
 	int buflen;
 
@@ -3754,7 +6830,7 @@ xdrawbar(void) {
 	}
 
 	if (defaultbarbg != defaultbg) {
-		XftDrawRect(xw.draw, &dc.col[defaultbarbg], borderpx,
+		xdrawrect(&dc.col[defaultbarbg], borderpx,
 			borderpx + focused_term->row * xw.ch,
 			(focused_term->col + 1) * xw.cw, xw.ch);
 		// To avoid a direct X call:
@@ -3770,7 +6846,7 @@ xdrawbar(void) {
 		attr.mode = ATTR_BOLD;
 		attr.fg = 10;
 		attr.bg = defaultbarbg;
-		xdraws("new", attr, drawn, focused_term->row, 3, 3);
+		xdrawbarstr("new", 3, attr, drawn);
 		drawn += 2;
 		drawn += 3;
 	}
@@ -3810,7 +6886,7 @@ xdrawbar(void) {
 			// if (clicked_mod) term_remove(term);
 			return;
 		}
-		xdraws(buf, attr, drawn, focused_term->row, buflen, buflen);
+		xdrawbarstr(buf, buflen, attr, drawn);
 		//drawn += 2; /* don't assume the state char is always present. */
 		drawn += 1; /* always assume there's an extra space from the state char. */
 		drawn += buflen;
@@ -3821,16 +6897,28 @@ xdrawbar(void) {
 		attr.fg = defaultbarfg;
 		attr.bg = defaultbarbg;
 		drawn += 1;
-		if (drawn + 8 + entry.pos > focused_term->col) {
+		/* in cells, as tputc() would lay the text out */
+		uint32_t u[sizeof(entry.text)];
+		int n = entrydecode(u), w = 0, k;
+		for (k = 0; k < n; k++)
+			w += WIDTH(u[k]);
+		if (drawn + 8 + w > focused_term->col) {
 			return;
 		}
-		char final[68];
-		snprintf(final, sizeof(final),
-			tstate == S_SEARCH ? "Search: %s" : "Rename: %s", entry.text);
-		xdraws(final, attr, drawn, focused_term->row, 8 + entry.pos, 8 + entry.pos);
-		drawn += 8 + entry.pos;
+		xdrawbarstr(tstate == S_SEARCH ? "Search: " : "Rename: ", 8,
+				attr, drawn);
+		drawn += 8;
+		for (k = 0; k < n; k++) {
+			Glyph g = attr;
+			if (!(w = WIDTH(u[k])))
+				continue;
+			if (w == 2)
+				g.mode |= ATTR_WIDE;
+			xdraws(&u[k], g, NULL, drawn, focused_term->row, 1);
+			drawn += w;
+		}
 		attr.bg = defaultbarfg;
-		xdraws(" ", attr, drawn, focused_term->row, 1, 1);
+		xdrawbarstr(" ", 1, attr, drawn);
 		drawn += 1;
 	}
 
@@ -3843,19 +6931,60 @@ xdrawbar(void) {
 		if (drawn + l > focused_term->col) {
 			return;
 		}
-		xdraws(status_msg, attr, drawn, focused_term->row, l, l);
+		xdrawbarstr(status_msg, l, attr, drawn);
+	}
+}
+
+/* Draw the n bytes of the UTF-8 string s in the bar from column x. */
+void
+xdrawbarstr(char *s, int n, Glyph attr, int x) {
+	uint32_t buf[128];
+	long u;
+	int i, len;
+
+	for(len = 0; n > 0 && len < LEN(buf); len++) {
+		i = utf8decode(s, &u);
+		buf[len] = u;
+		s += i;
+		n -= i;
+	}
+	xdraws(buf, attr, NULL, x, focused_term->row, len);
+}
+
+/* Decode the text of the entry into u, returning its length. */
+int
+entrydecode(uint32_t *u) {
+	char *s = entry.text;
+	long c;
+	int n = 0;
+
+	while(*s) {
+		s += utf8decode(s, &c);
+		u[n++] = c;
 	}
+	return n;
+}
+
+void
+barchanged(void) {
+	bargen++;
+	xdrawbar();
 }
 
 void
 expose(XEvent *ev) {
 	XExposeEvent *e = &ev->xexpose;
 
+	/* the back buffer still holds the exposed area */
+	xpresent(e->x, e->y, e->width, e->height);
+
+	/* rows that changed while we were obscured are still dirty */
 	if(xw.state & WIN_REDRAW) {
-		if(!e->count)
+		if(!e->count) {
 			xw.state &= ~WIN_REDRAW;
+			draw();
+		}
 	}
-	redraw(0);
 }
 
 void
@@ -3867,6 +6996,8 @@ visibility(XEvent *ev) {
 	} else if(!(xw.state & WIN_VISIBLE)) {
 		/* need a full redraw for next Expose, not just a buf copy */
 		xw.state |= WIN_VISIBLE | WIN_REDRAW;
+		if(focused_term->stale)
+			tfulldirt(focused_term);
 	}
 }
 
@@ -3919,6 +7050,13 @@ numlock(const Arg *dummy) {
 	focused_term->numlock ^= 1;
 }
 
+void
+togglelatency(const Arg *dummy) {
+	latencymode = !latencymode;
+	set_message("latency mode %s", latencymode ? "on" : "off");
+	xdrawbar();
+}
+
 char*
 kmap(KeySym k, uint state) {
 	uint mask;
@@ -3979,6 +7117,7 @@ kpress(XEvent *ev) {
 	long c;
 	Status status;
 	Shortcut *bp;
+	uint64_t start = showstats ? monotime() : 0;
 
 #ifdef USE_BLANK_CURSOR
 	xcursorblank();
@@ -4014,31 +7153,36 @@ kpress(XEvent *ev) {
 		Term *term = focused_term;
 		if (ksym == XK_Escape) {
 			tstate = S_NORMAL;
-			xdrawbar();
+			barchanged();
 			return;
 		}
 		if (ksym == XK_Return) {
 			tstate = S_NORMAL;
 			if (entry.pos == 0) {
-				xdrawbar();
+				barchanged();
 				return;
 			}
 			entry.text[entry.pos] = '\0';
 			term->title = strdup(entry.text);
-			xdrawbar();
+			barchanged();
 			return;
 		}
 		if (ksym == XK_BackSpace) {
 			if (entry.pos == 0) return;
-			entry.text[--entry.pos] = '\0';
-			xdrawbar();
+			/* a whole character */
+			while (--entry.pos > 0
+					&& (entry.text[entry.pos] & 0xc0) == 0x80)
+				/* nothing */;
+			entry.text[entry.pos] = '\0';
+			barchanged();
 			return;
 		}
-		if (len == 1) {
-			if (entry.pos < sizeof(entry.text) - 1) {
-				entry.text[entry.pos++] = xstr[0];
+		if (len > 0) {
+			if (entry.pos + len < sizeof(entry.text)) {
+				memcpy(entry.text + entry.pos, xstr, len);
+				entry.pos += len;
 				entry.text[entry.pos] = '\0';
-				xdrawbar();
+				barchanged();
 			}
 			return;
 		}
@@ -4062,31 +7206,29 @@ kpress(XEvent *ev) {
 
 			entry.text[entry.pos] = '\0';
 
-			Glyph *line;
+			Line line;
 			bool found = false;
 			bool wrapped = false;
 			int x = term->c.x + 1;
 			int y = term->c.y + term->ybase;
-			int yb, i;
+			int yb, n;
+			uint32_t u[sizeof(entry.text)];
 			bool up = ksym == XK_N
 				? !entry.flag
 				: entry.flag;
 
+			/* cells hold code points, so the text is decoded once */
+			n = entrydecode(u);
+
 			for (;;) {
 				line = GET_LINE(term, y);
 
 				while (x < term->col) {
-					for (i = 0; i < entry.pos; i++) {
-						if (x + i >= term->col) break;
-						if (line[x + i].c[0] != entry.text[i]) {
-							break;
-						} else if (line[x + i].c[0] == entry.text[i] && i == entry.pos - 1) {
-							found = true;
-							break;
-						}
+					if (lmatch(line, term->col, x, u, n)) {
+						found = true;
+						break;
 					}
-					if (found) break;
-					x += i + 1;
+					x++;
 				}
 				if (found) break;
 
@@ -4131,15 +7273,20 @@ kpress(XEvent *ev) {
 		}
 		if (ksym == XK_BackSpace) {
 			if (entry.pos == 0) return;
-			entry.text[--entry.pos] = '\0';
-			xdrawbar();
+			/* a whole character */
+			while (--entry.pos > 0
+					&& (entry.text[entry.pos] & 0xc0) == 0x80)
+				/* nothing */;
+			entry.text[entry.pos] = '\0';
+			barchanged();
 			return;
 		}
-		if (len == 1) {
-			if (entry.pos < sizeof(entry.text) - 1) {
-				entry.text[entry.pos++] = xstr[0];
+		if (len > 0) {
+			if (entry.pos + len < sizeof(entry.text)) {
+				memcpy(entry.text + entry.pos, xstr, len);
+				entry.pos += len;
 				entry.text[entry.pos] = '\0';
-				xdrawbar();
+				barchanged();
 			}
 			return;
 		}
@@ -4165,9 +7312,11 @@ kpress(XEvent *ev) {
 			entry.flag = ksym == XK_question;
 			entry.text[0] = '\0';
 			entry.pos = 0;
-			xdrawbar();
+			barchanged();
 		} else if (ksym == XK_h) {
 			tmoveto(term, term->c.x - 1, term->c.y);
+			if (TMODE(term, term->c.y)[term->c.x] & ATTR_WDUMMY)
+				tmoveto(term, term->c.x - 1, term->c.y);
 			if (tstate == S_VISUAL) SEND_MOUSE(bmotion);
 		} else if (ksym == XK_j) {
 			if (term->c.y == term->row - 1) {
@@ -4187,6 +7336,8 @@ kpress(XEvent *ev) {
 			UPDATE_SCROLL;
 		} else if (ksym == XK_l) {
 			tmoveto(term, term->c.x + 1, term->c.y);
+			if (TMODE(term, term->c.y)[term->c.x] & ATTR_WDUMMY)
+				tmoveto(term, term->c.x + 1, term->c.y);
 			if (tstate == S_VISUAL) SEND_MOUSE(bmotion);
 		} else if (ksym == XK_H || ksym == XK_M || ksym == XK_L) {
 			if (ksym == XK_H) {
@@ -4212,10 +7363,10 @@ kpress(XEvent *ev) {
 			if (ksym == XK_0) {
 				tmoveto(term, 0, term->c.y);
 			} else if (ksym == XK_asciicircum) {
-				Glyph *l = term->line[term->c.y];
+				Line l = term->line[term->c.y];
 				int x = 0;
 				while (x < term->col) {
-					if (l[x].c[0] > ' ') {
+					if (l[x] > ' ') {
 						break;
 					}
 					x++;
@@ -4231,9 +7382,9 @@ kpress(XEvent *ev) {
 			bool saw_space = false;
 
 			for (;;) {
-				Glyph *l = GET_LINE(term, y + yb);
+				Line l = GET_LINE(term, y + yb);
 				while (x < term->col) {
-					if (l[x].c[0] <= ' ') {
+					if (l[x] <= ' ') {
 						saw_space = true;
 					} else if (saw_space) {
 						break;
@@ -4241,7 +7392,7 @@ kpress(XEvent *ev) {
 					x++;
 				}
 				if (x >= term->col) x = term->col - 1;
-				if (x == term->col - 1 && l[x].c[0] <= ' ') {
+				if (x == term->col - 1 && l[x] <= ' ') {
 					x = 0;
 					if (++y >= term->row) {
 						y--;
@@ -4266,17 +7417,17 @@ kpress(XEvent *ev) {
 			if (x >= term->col) x--;
 
 			for (;;) {
-				Glyph *l = GET_LINE(term, y + yb);
+				Line l = GET_LINE(term, y + yb);
 				while (x < term->col) {
-					if (l[x].c[0] <= ' ') {
+					if (l[x] <= ' ') {
 						x++;
 					} else {
 						break;
 					}
 				}
 				while (x < term->col) {
-					if (l[x].c[0] <= ' ') {
-						if (x - 1 >= 0 && l[x-1].c[0] > ' ') {
+					if (l[x] <= ' ') {
+						if (x - 1 >= 0 && l[x-1] > ' ') {
 							x--;
 							break;
 						}
@@ -4284,7 +7435,7 @@ kpress(XEvent *ev) {
 					x++;
 				}
 				if (x >= term->col) x = term->col - 1;
-				if (x == term->col - 1 && l[x].c[0] <= ' ') {
+				if (x == term->col - 1 && l[x] <= ' ') {
 					x = 0;
 					if (++y >= term->row) {
 						y--;
@@ -4307,11 +7458,11 @@ kpress(XEvent *ev) {
 			int yb = term->ybase;
 
 			for (;;) {
-				Glyph *l = GET_LINE(term, y + yb);
-				bool saw_space = x > 0 && l[x].c[0] > ' ' && l[x-1].c[0] > ' ';
+				Line l = GET_LINE(term, y + yb);
+				bool saw_space = x > 0 && l[x] > ' ' && l[x-1] > ' ';
 				while (x >= 0) {
-					if (l[x].c[0] <= ' ') {
-						if (saw_space && (x + 1 < term->col && l[x+1].c[0] > ' ')) {
+					if (l[x] <= ' ') {
+						if (saw_space && (x + 1 < term->col && l[x+1] > ' ')) {
 							x++;
 							break;
 						} else {
@@ -4321,7 +7472,7 @@ kpress(XEvent *ev) {
 					x--;
 				}
 				if (x < 0) x = 0;
-				if (x == 0 && (l[x].c[0] <= ' ' || !saw_space)) {
+				if (x == 0 && (l[x] <= ' ' || !saw_space)) {
 					x = term->col - 1;
 					if (--y < 0) {
 						y++;
@@ -4340,10 +7491,10 @@ kpress(XEvent *ev) {
 			tmoveto(term, x, y);
 			if (tstate == S_VISUAL) SEND_MOUSE(bmotion);
 		} else if (ksym == XK_dollar) {
-			Glyph *l = term->line[term->c.y];
+			Line l = term->line[term->c.y];
 			int x = term->col - 1;
 			while (x >= 0) {
-				if (l[x].c[0] > ' ') {
+				if (l[x] > ' ') {
 					//if (tstate == S_VISUAL && x < term->col - 1) x++;
 					break;
 				}
@@ -4353,7 +7504,7 @@ kpress(XEvent *ev) {
 			tmoveto(term, x, term->c.y);
 			if (tstate == S_VISUAL) SEND_MOUSE(bmotion);
 		} else if (ksym == XK_braceleft || ksym == XK_braceright) {
-			Glyph *line;
+			Line line;
 			bool saw_full = false;
 			bool found = false;
 			int first_is_space = -1;
@@ -4377,7 +7528,7 @@ kpress(XEvent *ev) {
 				line = GET_LINE(term, y + yb);
 
 				for (i = 0; i < term->col; i++) {
-					if (line[i].c[0] > ' ') {
+					if (line[i] > ' ') {
 						if (first_is_space == -1) {
 							first_is_space = 0;
 						}
@@ -4494,7 +7645,7 @@ kpress(XEvent *ev) {
 			tstate = S_RENAME;
 			entry.text[0] = '\0';
 			entry.pos = 0;
-			xdrawbar();
+			barchanged();
 			return;
 		}
 		if (ksym == XK_p || ksym == XK_bracketright) {
@@ -4553,7 +7704,16 @@ kpress(XEvent *ev) {
 		len = cp - buf + len;
 	}
 
+	lastkey = monotime();
 	ttywrite(focused_term, buf, len);
+
+	/* follow this key, unless one is already followed and not stuck */
+	if(showstats && (!keyprobe.key || lastkey - keyprobe.key > 1000000)) {
+		keyprobe.key = start;
+		keyprobe.term = focused_term;
+		keyprobe.stage = -1;
+		probekey(KEY_WRITE);
+	}
 	if(IS_SET(focused_term, MODE_ECHO))
 		techo(focused_term, buf, len);
 }
@@ -4618,7 +7778,7 @@ resize(XEvent *e) {
 
 void
 term_add(void) {
-	Term *term;
+	Term *term, *old = focused_term;
 
 	if (!terms) {
 		terms = (Term *)xmalloc(sizeof(Term));
@@ -4635,6 +7795,7 @@ term_add(void) {
 		memset(term->next, 0, sizeof(Term));
 		focused_term = term->next;
 		tnew(focused_term, terms->col, terms->row);
+		xswapbuf(old);
 		char **temp = opt_cmd;
 		opt_cmd = NULL;
 		ttynew(focused_term);
@@ -4648,11 +7809,13 @@ term_add(void) {
 		}
 	}
 
+	bargen++;
 	redraw(0);
 }
 
 void
 term_remove(Term *target) {
+	Term *old = focused_term;
 	int i;
 
 	if (terms == target) {
@@ -4668,8 +7831,11 @@ term_remove(Term *target) {
 		term->next = target->next;
 		focused_term = term;
 	}
+	xswapbuf(old);
 
 	// Free up memory
+	if (target->buf)
+		XFreePixmap(xw.dpy, target->buf);
 	for (i = 0; i < target->row; i++) {
 		free(target->line[i]);
 		free(target->alt[i]);
@@ -4686,6 +7852,11 @@ term_remove(Term *target) {
 	free(target->sb);
 	free(target->dirty);
 	free(target->tabs);
+	for (i = 0; i < target->ncluster; i++) {
+		free(target->clusters[i].u);
+	}
+	free(target->clusters);
+	free(target->clusterhash);
 	free(target);
 
 	if (autohide) {
@@ -4695,15 +7866,26 @@ term_remove(Term *target) {
 		}
 	}
 
+	bargen++;
 	redraw(0);
 }
 
 void
 term_focus(Term *target) {
+	Term *old = focused_term;
+
 	focused_term->has_activity = false;
 	focused_term = target == NULL ? terms : target;
 	focused_term->has_activity = false;
-	redraw(0);
+	bargen++;
+
+	/* a tab that did not change while away only has to be copied */
+	if(xswapbuf(old)) {
+		xdamage(0, 0, xw.w, xw.h);
+		draw();
+	} else {
+		redraw(0);
+	}
 }
 
 void
@@ -4737,12 +7919,34 @@ term_focus_idx(int idx) {
 	}
 }
 
+/* Handle the queued X events, returns whether any was not our own. */
+int
+xevents(void) {
+	XEvent ev;
+	int input = 0;
+
+	while(XPending(xw.dpy)) {
+		XNextEvent(xw.dpy, &ev);
+		if(XFilterEvent(&ev, None))
+			continue;
+		if(ev.type != GenericEvent)
+			input = 1;
+		if(handler[ev.type])
+			(handler[ev.type])(&ev);
+	}
+	return input;
+}
+
 void
 run(void) {
-	XEvent ev;
 	fd_set rfd;
 	int xfd = XConnectionNumber(xw.dpy), xev, blinkset = 0, dodraw = 0;
-	struct timeval drawtimeout, *tv = NULL, now, last, lastblink;
+	int n, flood = 0, wanted = 1, echo, synced = 0, fgbusy;
+	struct timeval drawtimeout, bgtimeout, *tv = NULL, now, last, lastblink;
+	uint64_t t, wait;
+#ifdef USE_PRESENT
+	long wake, ms;
+#endif
 
 	gettimeofday(&lastblink, NULL);
 	gettimeofday(&last, NULL);
@@ -4751,12 +7955,37 @@ run(void) {
 		Term *term, *next;
 		int lastfd = 0;
 
+		if(statsrequested) {
+			statsrequested = 0;
+			stats();
+		}
+
 		FD_ZERO(&rfd);
+		t = monotime();
+		wait = 0;
+		/* the shown tab has output to take in or a frame to draw */
+		fgbusy = (xw.state & WIN_VISIBLE) && (flood || wanted);
 		for (term = terms; term; term = term->next) {
+			/* other tabs wait for their turn while it is busy */
+			if(fgbusy && term != focused_term
+					&& term->nextread > t) {
+				if(!wait || term->nextread - t < wait)
+					wait = term->nextread - t;
+				continue;
+			}
 			FD_SET(term->cmdfd, &rfd);
 			lastfd = MAX(term->cmdfd, lastfd);
 		}
 		FD_SET(xfd, &rfd);
+		if(fbpipe[0] != -1) {
+			FD_SET(fbpipe[0], &rfd);
+			lastfd = MAX(fbpipe[0], lastfd);
+		}
+		if(wait && (!tv || tv->tv_sec * 1000000ULL + tv->tv_usec > wait)) {
+			bgtimeout.tv_sec = wait / 1000000;
+			bgtimeout.tv_usec = wait % 1000000;
+			tv = &bgtimeout;
+		}
 
 		if(select(MAX(xfd, lastfd)+1, &rfd, NULL, NULL, tv) < 0) {
 			if(errno == EINTR)
@@ -4764,25 +7993,50 @@ run(void) {
 			die("select failed: %s\n", SERRNO);
 		}
 
+		/* in latency mode, keys go before output that is waiting */
+		if(latencymode && FD_ISSET(xfd, &rfd) && xevents())
+			wanted = 1;
+
+		echo = 0;
 		for (term = terms; term; term = next) {
 			next = term->next;
 			if(FD_ISSET(term->cmdfd, &rfd)) {
-				if (ttyread(term) == -1) {
+				if(!ISSHOWN(term)) {
+					ttyreadbatch(term);
+					continue;
+				}
+				if ((n = ttyread(term)) == -1) {
 					/* potentially move if-block from ttyread here */
 					continue;
 				}
-				/* potentially only do this and the below blink code for focused_term */
-				if(blinktimeout) {
-					blinkset = tattrset(term, ATTR_BLINK);
-					if(!blinkset && term->mode & ATTR_BLINK)
-						term->mode &= ~(MODE_BLINK);
+				if(n > 0 && term == keyprobe.term)
+					probekey(KEY_READ);
+				if(term != focused_term)
+					continue;
+				flood += n;
+				if(n > 0 && latencymode && monotime() - lastkey
+						< echotimeout * 1000ULL) {
+					echo = 1;
 				}
 			}
 		}
 
+		if(fbpipe[0] != -1 && FD_ISSET(fbpipe[0], &rfd)) {
+			xfallbackpoll();
+			wanted = 1;
+		}
+
 		if(FD_ISSET(xfd, &rfd))
 			xev = actionfps;
 
+		/* a hidden window only handles events and reads */
+		if(!(xw.state & WIN_VISIBLE)) {
+			if(FD_ISSET(xfd, &rfd))
+				xevents();
+			tv = NULL;
+			continue;
+		}
+
 		gettimeofday(&now, NULL);
 		drawtimeout.tv_sec = 0;
 		drawtimeout.tv_usec = (1000/xfps) * 1000;
@@ -4793,11 +8047,18 @@ run(void) {
 			for (term = terms; term; term = term->next) {
 				char *title = getproc(term->cmdfd, NULL);
 				if (title == NULL) continue;
+				char *btitle = basename(title);
+				if (btitle && term->title
+						&& !strcmp(btitle, term->title)) {
+					free(title);
+					continue;
+				}
 				if (term->title) {
 					free(term->title);
 					term->title = NULL;
 				}
-				char *btitle = basename(title);
+				bargen++;
+				wanted = 1;
 				if (btitle == NULL) {
 					free(title);
 					continue;
@@ -4813,34 +8074,119 @@ run(void) {
 		dodraw = 0;
 		if(blinktimeout && TIMEDIFF(now, lastblink) > blinktimeout) {
 			for (term = terms; term; term = term->next) {
-				tsetdirtattr(term, ATTR_BLINK);
+				if(ISSHOWN(term) && term->nblink)
+					tsetdirtattr(term, ATTR_BLINK);
 				term->mode ^= MODE_BLINK;
 			}
 			gettimeofday(&lastblink, NULL);
-			dodraw = 1;
+			dodraw = wanted = 1;
 		}
 		if(TIMEDIFF(now, last) \
 				> (xev? (1000/xfps) : (1000/actionfps))) {
 			dodraw = 1;
+		}
+
+#ifdef USE_PRESENT
+		/*
+		 * With Present, frames are drawn right before a vblank instead
+		 * of on the timer, and only when something changed.
+		 */
+		if(present.opcode) {
+			if(FD_ISSET(xfd, &rfd) && xevents())
+				wanted = 1;
+			if(flood || (status_msg
+					&& TIMEDIFF(now, status_time) > 3000)) {
+				wanted = 1;
+			}
+			dodraw = wanted && presentdue(&drawtimeout);
+
+			/* idle: sleep until the next blink or status expiry */
+			if(!wanted) {
+				wake = -1;
+				if(blinktimeout && focused_term->nblink) {
+					wake = MAX(1, blinktimeout
+						- TIMEDIFF(now, lastblink));
+				}
+				if(status_msg) {
+					ms = MAX(1, 3000 - TIMEDIFF(now, status_time));
+					if(wake < 0 || ms < wake)
+						wake = ms;
+				}
+				tv = NULL;
+				if(wake > 0) {
+					drawtimeout.tv_sec = wake / 1000;
+					drawtimeout.tv_usec = wake % 1000 * 1000;
+					tv = &drawtimeout;
+				}
+			}
+		}
+#endif
+
+		/*
+		 * Jump scroll: while the output still floods in, nobody can
+		 * read the intermediate screens, so only the last one is drawn.
+		 */
+		if(dodraw && FD_ISSET(focused_term->cmdfd, &rfd)
+				&& flood > focused_term->row * focused_term->col
+				&& TIMEDIFF(now, last) < jumplatency) {
+			dodraw = 0;
+		}
+
+		/* the answer to a key is drawn right away */
+		if(echo)
+			dodraw = 1;
+
+		/*
+		 * During a synchronized update the screen is half redrawn, so
+		 * frames wait for its end, which is drawn at once.
+		 */
+		if(IS_SET(focused_term, MODE_SYNC)) {
+			if(monotime() - focused_term->syncstart
+					< synctimeout * 1000ULL) {
+				dodraw = 0;
+			} else {
+				focused_term->mode &= ~MODE_SYNC;
+			}
+		}
+		if(synced && !IS_SET(focused_term, MODE_SYNC))
+			dodraw = 1;
+		synced = IS_SET(focused_term, MODE_SYNC);
+
+		if(dodraw) {
 			last = now;
+			flood = 0;
 		}
 
 		if(dodraw) {
-			while(XPending(xw.dpy)) {
-				XNextEvent(xw.dpy, &ev);
-				if(XFilterEvent(&ev, None))
-					continue;
-				if(handler[ev.type])
-					(handler[ev.type])(&ev);
-			}
+			xevents();
 
 			if (status_msg && TIMEDIFF(now, status_time) > 3000) {
 				free(status_msg);
 				status_msg = NULL;
+				bargen++;
+			}
+
+			/* once a frame, instead of after every read */
+			if(blinktimeout) {
+				blinkset = focused_term->nblink > 0;
+				if(!blinkset && focused_term->mode & MODE_BLINK)
+					focused_term->mode &= ~(MODE_BLINK);
 			}
 
+			probekey(KEY_DRAW);
 			draw();
 			XFlush(xw.dpy);
+			wanted = 0;
+
+			probekey(KEY_FLUSH);
+			if(keyprobe.stage == KEY_FLUSH) {
+#ifdef USE_PRESENT
+				if(present.opcode)
+					keyprobe.serial = present.serial;
+				else
+#endif
+				keyprobe.key = 0;
+			}
 
 			if(xev && !FD_ISSET(xfd, &rfd))
 				xev--;
@@ -4866,7 +8212,7 @@ run(void) {
 void
 usage(void) {
 	die("%s " VERSION " (c) 2010-2013 st engineers\n" \
-	"usage: st [-a] [-v] [-c class] [-f font] [-g geometry] [-o file]" \
+	"usage: st [-a] [-l] [-s] [-v] [-c class] [-f font] [-g geometry] [-o file]" \
 	" [-t title] [-w windowid] [-e command ...]\n", argv0);
 }
 
@@ -4922,6 +8268,12 @@ main(int argc, char *argv_[]) {
 	case 'o':
 		opt_io = EARGF(usage());
 		break;
+	case 'l':
+		showstats = true;
+		break;
+	case 's':
+		softrender = true;
+		break;
 	case 't':
 	case 'T':
 		opt_title = EARGF(usage());